@@ -29,6 +29,7 @@ PsychicWebSocketProxy::Server websocket_handler([] { return new PsychicWebSocket
 // Alternative examples:
 //   PsychicWebSocketProxy::Server websocket_handler([]{ return new PsychicWebSocketProxy::CircularBufferProxy(512, 10 * 1000, ESP_OK); });
 //   PsychicWebSocketProxy::Server websocket_handler([]{ return new PsychicWebSocketProxy::SingleFrameProxy(10 * 1000); });
+//   PsychicWebSocketProxy::Server websocket_handler([]{ return new PsychicWebSocketProxy::FrameQueueProxy(4, 1024); });
 //
 // Note that most proxy constructors take 3 parameters:
 //  * (max) buffer size  -- specifies the size of the preallocated buffer or the maximum memory that can be used by one connection
@@ -40,6 +41,15 @@ PsychicWebSocketProxy::Server websocket_handler([] { return new PsychicWebSocket
 //                          sent via the websocket.  This can cause a protocol error, but should be handled ok.  In case of protocol errors,
 //                          PicoMQTT will remaining stable, but drop the connection.  Otherwise, the only consequence is potentially missing
 //                          messages.
+//
+// StaticBufferProxy, ShiftingBufferProxy, CircularBufferProxy and DynamicBufferProxy take 2 more optional parameters:
+//  * spill_limit        -- maximum size of a frame, which doesn't fit in the buffer, but can still be received into a temporary
+//                          spill buffer instead of failing; defaults to 0, which disables spilling
+//  * spill_caps         -- heap capabilities used to allocate the spill buffer, e.g. MALLOC_CAP_SPIRAM to use PSRAM
+//
+// FrameQueueProxy takes 2 extra parameters in front of timeout_ms and error_on_no_memory:
+//  * slot_count         -- number of frames, which can be queued before the async recv function starts waiting
+//  * max_frame_size     -- size of the largest frame accepted; defaults to 0, which means no limit
 
 // Initialize a PicoMQTT::Server using the PsychicWebSocketProxy::Server
 // object as the server to use.
@@ -4,9 +4,14 @@
 #include "PsychicWebSocketProxy/naive_proxy.h"
 #include "PsychicWebSocketProxy/dynamic_buffer_proxy.h"
 #include "PsychicWebSocketProxy/single_frame_proxy.h"
+#include "PsychicWebSocketProxy/frame_queue_proxy.h"
 #include "PsychicWebSocketProxy/static_buffer_proxy.h"
 #include "PsychicWebSocketProxy/shifting_buffer_proxy.h"
 #include "PsychicWebSocketProxy/circular_buffer_proxy.h"
+#include "PsychicWebSocketProxy/direct_dispatch_proxy.h"
 
 #include "PsychicWebSocketProxy/server.h"
 #include "PsychicWebSocketProxy/client.h"
+#include "PsychicWebSocketProxy/coroutine.h"
+#include "PsychicWebSocketProxy/rate_limit.h"
+#include "PsychicWebSocketProxy/tracer.h"
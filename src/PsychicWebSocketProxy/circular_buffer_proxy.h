@@ -14,25 +14,40 @@ namespace PsychicWebSocketProxy {
  *
  * The implementation of this class uses ShiftingBufferProxy as a base, because some of it's methods
  * can be reused.
+ *
+ * One byte of the buffer always stays free to tell a full buffer from an empty one, so frames of size
+ * bytes or more never fit.  With spill_limit set, they're received into the spill buffer instead (see
+ * StaticBufferProxy).
  */
 class CircularBufferProxy: public ShiftingBufferProxy {
     public:
+        using ShiftingBufferProxy::ShiftingBufferProxy;
+
         virtual esp_err_t recv(httpd_req_t * request, httpd_ws_frame_t * frame) override {
             const size_t frame_size = frame->len;
 
             std::unique_lock<std::mutex> lock(recv_mutex);
 
+            if (frame_size >= size) {
+                // the buffer holds at most size - 1 bytes
+                return receive_spill(request, frame, lock);
+            }
+
             if (!cond.wait_for(
                         lock,
                         timeout,
             [this, frame_size]() -> bool {
-            if (read_ptr <= write_ptr) {
+            if (!connected()) {
+                    return true;
+                } else if (spill) {
+                    return false;
+                } else if (read_ptr <= write_ptr) {
                     const size_t space_tail = (buffer + size) - write_ptr;
                     const size_t space_head = read_ptr - buffer;
                     const size_t space_total = space_tail + space_head - 1;
                     return frame_size <= space_total;
                 } else {
-                    const size_t space_middle = read_ptr - read_ptr;
+                    const size_t space_middle = read_ptr - write_ptr;
                     const size_t space_tail = (buffer + size) - read_wrap;
                     const size_t space_total = space_middle + space_tail - 1;
                     return frame_size <= space_total;
@@ -42,6 +57,11 @@ class CircularBufferProxy: public ShiftingBufferProxy {
                 return error_on_no_memory;
             }
 
+            if (!connected()) {
+                // connection closed while waiting, the buffer is already gone
+                return ESP_FAIL;
+            }
+
             if (read_ptr <= write_ptr) {
                 /*
                     |.....#####.....|
@@ -84,9 +104,10 @@ class CircularBufferProxy: public ShiftingBufferProxy {
                     +--------------- buffer
                 */
 
-                const size_t space_middle = read_ptr - read_ptr;
+                const size_t space_middle = read_ptr - write_ptr;
 
-                if (space_middle < frame_size) {
+                // write_ptr must stay behind read_ptr, otherwise the buffer would look empty
+                if (space_middle <= frame_size) {
                     // not enough space in the middle, shift tail to the end of the buffer
                     shift_buffer_tail();
                 }
@@ -95,15 +116,6 @@ class CircularBufferProxy: public ShiftingBufferProxy {
 
         }
 
-        virtual int available() {
-            const std::lock_guard<std::mutex> lock(recv_mutex);
-            if (read_ptr <= write_ptr) {
-                return write_ptr - read_ptr;
-            } else {
-                return (read_wrap - read_ptr) + (write_ptr - buffer);
-            }
-        }
-
         virtual int read(uint8_t * ptr, size_t len) {
             const std::lock_guard<std::mutex> lock(recv_mutex);
 
@@ -132,15 +144,27 @@ class CircularBufferProxy: public ShiftingBufferProxy {
                 memcpy(dst_ptr, read_ptr, bytes_to_read);
                 read_ptr += bytes_to_read;
                 dst_ptr += bytes_to_read;
-                // len -= bytes_to_read;
+                len -= bytes_to_read;
             }
 
-            cond.notify_all();
+            data_changed();
+
+            // if there's still space left, the main buffer is empty, continue with the spill buffer
+            dst_ptr += read_spill(dst_ptr, len);
 
             return dst_ptr - ptr;
         }
 
     protected:
+        virtual size_t buffered() override {
+            const size_t spill_buffered = spill_size - spill_offset;
+            if (read_ptr <= write_ptr) {
+                return (write_ptr - read_ptr) + spill_buffered;
+            } else {
+                return (read_wrap - read_ptr) + (write_ptr - buffer) + spill_buffered;
+            }
+        }
+
         /* Move the unread contents of the buffer to free up space in the middle.
             before:
                 |#####.....###..|
@@ -159,7 +183,7 @@ class CircularBufferProxy: public ShiftingBufferProxy {
         */
         void shift_buffer_tail() {
             const size_t shift_size = buffer + size - read_wrap;
-            memmove(read_ptr + shift_size, read_ptr, shift_size);
+            memmove(read_ptr + shift_size, read_ptr, read_wrap - read_ptr);
             read_ptr += shift_size;
             read_wrap = buffer + size;
         }
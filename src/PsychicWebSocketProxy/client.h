@@ -1,6 +1,6 @@
 #pragma once
 
-#include <memory>
+#include <initializer_list>
 #include <Arduino.h>
 #include "proxy.h"
 
@@ -8,8 +8,33 @@ namespace PsychicWebSocketProxy {
 
 class Client: public ::Client {
     public:
-        Client(const std::shared_ptr<Proxy> & proxy = nullptr): proxy(proxy) {}
-        Client(const Client & other) = default;
+        Client(Proxy * proxy = nullptr): proxy(proxy) {
+            if (proxy) {
+                proxy->acquire();
+            }
+        }
+
+        Client(const Client & other): ::Client(other), proxy(other.proxy) {
+            if (proxy) {
+                proxy->acquire();
+            }
+        }
+
+        Client(Client && other): ::Client(other), proxy(other.proxy) {
+            other.proxy = nullptr;
+        }
+
+        Client & operator=(Client other) {
+            ::Client::operator=(other);
+            std::swap(proxy, other.proxy);
+            return *this;
+        }
+
+        virtual ~Client() {
+            if (proxy) {
+                proxy->release();
+            }
+        }
 
         // dummy implementations -- they're not needed but have to be defined, because they're abstract in ::Client
         virtual int connect(IPAddress ip, uint16_t port) { return 0; }
@@ -23,15 +48,46 @@ class Client: public ::Client {
         // client is valid using the connected() method or by convertingt to bool.  These two methods have the NULL
         // check in place.
         virtual size_t write(const uint8_t * buffer, size_t size) override { return proxy->send(buffer, size); }
-        virtual int read(uint8_t * buffer, size_t size) override { return proxy->read(buffer, size); }
+        // Send multiple segments as a single frame, e.g. client.write({{header, header_size}, {payload, payload_size}})
+        size_t write(const Segment * segments, size_t count) { return proxy->send(segments, count); }
+        size_t write(std::initializer_list<Segment> segments) { return proxy->send(segments.begin(), segments.size()); }
+        // Free the buffer used by the scatter-gather write(), see Proxy::release_send_buffer()
+        void release_send_buffer() { proxy->release_send_buffer(); }
+        virtual int read(uint8_t * buffer, size_t size) override {
+            const int ret = proxy->read(buffer, size);
+            proxy->trace(FrameTracer::READ, 0, size, ret);
+            return ret;
+        }
         virtual int available() override { return proxy->available(); }
         virtual int peek() override { return proxy->peek(); }
-        virtual void stop() override { proxy->set_websocket_client(nullptr); }
+        virtual void stop() override { stop(1000); }
+        // Close the connection, sending a close frame with the given status code first (unless it's 0)
+        void stop(uint16_t status_code) { proxy->close(status_code); }
         virtual uint8_t connected() override final { return proxy && proxy->connected(); }
 
         // NOTE: This is implemented in the same way as in WiFiClient -- returns true if we're connected or if there's still some unread data remaining
         virtual operator bool() { return proxy && (proxy->available() || proxy->connected()); }
 
+        /* Blocking reads.  These wait up to the Stream timeout (see Stream::setTimeout()) for data to arrive.  Unlike
+         * Stream::timedRead() and Stream::timedPeek(), which keep polling read() and peek(), they sleep until the proxy
+         * receives data or the connection drops.
+         */
+        int timedRead() { return proxy->wait_available(getTimeout()) ? read() : -1; }
+        int timedPeek() { return proxy->wait_available(getTimeout()) ? peek() : -1; }
+
+        using ::Client::readBytes;
+        virtual size_t readBytes(char * buffer, size_t length) override {
+            size_t count = 0;
+            while ((count < length) && proxy->wait_available(getTimeout())) {
+                count += read((uint8_t *) buffer + count, length - count);
+            }
+            return count;
+        }
+
+        // See Proxy::set_receive_callback() and Proxy::cancel_receive_callback()
+        void set_receive_callback(std::function<void()> callback) { proxy->set_receive_callback(std::move(callback)); }
+        bool cancel_receive_callback() { return proxy->cancel_receive_callback(); }
+
         virtual size_t write(uint8_t c) override final { return write(&c, 1); }
         virtual int read() override final {
             uint8_t c;
@@ -39,7 +95,7 @@ class Client: public ::Client {
         }
 
     protected:
-        const std::shared_ptr<Proxy> proxy;
+        Proxy * proxy;
 };
 
 }
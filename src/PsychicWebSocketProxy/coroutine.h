@@ -0,0 +1,217 @@
+#pragma once
+
+/* Optional C++20 coroutine interface for Client objects.
+ *
+ * Instead of polling Client::available() and Client::read() in a loop, a connection can be handled by a coroutine,
+ * which suspends until data arrives.  Many such coroutines can be run by a single Scheduler on one task:
+ *
+ *     PsychicWebSocketProxy::Scheduler scheduler;
+ *
+ *     PsychicWebSocketProxy::Task echo(PsychicWebSocketProxy::Client client) {
+ *         uint8_t buffer[64];
+ *         while (true) {
+ *             const size_t size = co_await scheduler.read_some(client, buffer, sizeof(buffer));
+ *             if (!size) {
+ *                 break;  // disconnected
+ *             }
+ *             client.write(buffer, size);
+ *         }
+ *     }
+ *
+ *     void loop() {
+ *         auto client = websocket_handler.accept();
+ *         if (client) {
+ *             scheduler.spawn(echo(client));
+ *         }
+ *         scheduler.run_pending();
+ *     }
+ *
+ * Coroutines are woken up by the proxy's receive callback (see Proxy::set_receive_callback()), so only one coroutine
+ * should wait on a given Client at a time.  Writes are not buffered -- Client::write() sends the frame right away --
+ * so there's no awaitable for writing.
+ *
+ * This is only available when compiling with coroutine support (e.g. -std=gnu++20).
+ */
+
+#if __has_include(<coroutine>) && defined(__cpp_impl_coroutine)
+
+#include <condition_variable>
+#include <coroutine>
+#include <exception>
+#include <functional>
+#include <list>
+#include <mutex>
+
+#include "client.h"
+
+namespace PsychicWebSocketProxy {
+
+/* Coroutine type for connection handlers.  The coroutine starts suspended and is started by Scheduler::spawn().  It
+ * destroys itself when it finishes.
+ */
+class Task {
+    public:
+        struct promise_type {
+            Task get_return_object() { return Task(std::coroutine_handle<promise_type>::from_promise(*this)); }
+            std::suspend_always initial_suspend() noexcept { return {}; }
+            std::suspend_never final_suspend() noexcept { return {}; }
+            void return_void() {}
+            void unhandled_exception() { std::terminate(); }
+        };
+
+        Task(Task && other): handle(other.handle) { other.handle = nullptr; }
+        Task(const Task & other) = delete;
+        const Task & operator=(const Task & other) = delete;
+
+        ~Task() {
+            if (handle) {
+                // never started
+                handle.destroy();
+            }
+        }
+
+        std::coroutine_handle<> release() {
+            std::coroutine_handle<> ret = handle;
+            handle = nullptr;
+            return ret;
+        }
+
+    protected:
+        Task(std::coroutine_handle<promise_type> handle): handle(handle) {}
+
+        std::coroutine_handle<promise_type> handle;
+};
+
+class Scheduler {
+    public:
+        /* Awaitable, which reads data from a client.  It completes when at least min_size bytes were read or when the
+         * client disconnects.  The result of co_await is the number of bytes read.
+         */
+        class ReadAwaitable {
+            public:
+                ReadAwaitable(Scheduler & scheduler, Client & client, uint8_t * buffer, size_t size, size_t min_size):
+                    scheduler(scheduler), client(client), buffer(buffer), size(size), min_size(min_size),
+                    bytes_read(0) {}
+
+                bool await_ready() { return step(); }
+
+                bool await_suspend(std::coroutine_handle<> handle) {
+                    this->handle = handle;
+                    return wait();
+                }
+
+                size_t await_resume() const { return bytes_read; }
+
+            protected:
+                // read whatever is available, returns true if the read is complete
+                bool step() {
+                    if ((bytes_read < size) && (client.available() > 0)) {
+                        bytes_read += client.read(buffer + bytes_read, size - bytes_read);
+                    }
+                    return (bytes_read >= min_size) || !client;
+                }
+
+                // register for receive notifications, returns false if the read completed in the meantime
+                bool wait() {
+                    while (true) {
+                        client.set_receive_callback([this] {
+                            scheduler.post([this] {
+                                if (step() || !wait()) {
+                                    handle.resume();
+                                }
+                            });
+                        });
+
+                        if (client.available() <= 0 && client.connected()) {
+                            // nothing to read yet, the callback will resume us
+                            return true;
+                        }
+
+                        if (!client.cancel_receive_callback()) {
+                            // the callback was already called, it will resume us
+                            return true;
+                        }
+
+                        if (step()) {
+                            return false;
+                        }
+                    }
+                }
+
+                Scheduler & scheduler;
+                Client & client;
+                uint8_t * const buffer;
+                const size_t size;
+                const size_t min_size;
+                size_t bytes_read;
+                std::coroutine_handle<> handle;
+        };
+
+        Scheduler() {}
+
+        Scheduler(const Scheduler & other) = delete;
+        const Scheduler & operator=(const Scheduler & other) = delete;
+
+        // Read exactly size bytes, unless the client disconnects earlier
+        ReadAwaitable read(Client & client, uint8_t * buffer, size_t size) {
+            return ReadAwaitable(*this, client, buffer, size, size);
+        }
+
+        // Read at least one byte and at most size bytes.  With SingleFrameProxy, this reads at most one frame.
+        ReadAwaitable read_some(Client & client, uint8_t * buffer, size_t size) {
+            return ReadAwaitable(*this, client, buffer, size, size ? 1 : 0);
+        }
+
+        // Start running a coroutine on this scheduler
+        void spawn(Task && task) {
+            const std::coroutine_handle<> handle = task.release();
+            post([handle] { handle.resume(); });
+        }
+
+        // Queue a function to run on the scheduler's task, this can be called from any task
+        void post(std::function<void()> function) {
+            {
+                const std::lock_guard<std::mutex> lock(mutex);
+                queue.push_back(std::move(function));
+            }
+            cond.notify_one();
+        }
+
+        // Run all queued functions, returns the number of functions run
+        size_t run_pending() {
+            size_t count = 0;
+            std::list<std::function<void()>> pending;
+            while (true) {
+                {
+                    const std::lock_guard<std::mutex> lock(mutex);
+                    pending.swap(queue);
+                }
+                if (pending.empty()) {
+                    return count;
+                }
+                for (auto & function : pending) {
+                    function();
+                    ++count;
+                }
+                pending.clear();
+            }
+        }
+
+        // Wait up to timeout_ms for work to arrive and run it
+        size_t run(unsigned long timeout_ms) {
+            {
+                std::unique_lock<std::mutex> lock(mutex);
+                cond.wait_for(lock, std::chrono::milliseconds(timeout_ms), [this] { return !queue.empty(); });
+            }
+            return run_pending();
+        }
+
+    protected:
+        std::mutex mutex;
+        std::condition_variable cond;
+        std::list<std::function<void()>> queue;
+};
+
+}
+
+#endif
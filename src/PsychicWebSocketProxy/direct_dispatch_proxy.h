@@ -0,0 +1,153 @@
+#pragma once
+
+#include <atomic>
+#include <functional>
+
+#include <Arduino.h>
+
+#include "client.h"
+#include "proxy.h"
+
+namespace PsychicWebSocketProxy {
+
+/* This proxy doesn't queue received data at all.  Instead, each frame is received into a reusable scratch buffer
+ * and passed straight to a handler function.  The buffer is grown on demand, like in SingleFrameProxy.  This saves
+ * one copy and all the queuing latency, but it's only suitable for handlers, which process messages quickly.
+ *
+ * The handler is called from the server's task (inside Server::handleRequest), so while it runs, no other
+ * websocket traffic is processed.  The time spent in the handler is measured.  Each call taking longer than
+ * time_budget_us microseconds is counted as an overrun and makes recv() return error_on_overrun.  The default is
+ * ESP_FAIL, which closes the connection, so a slow handler can't stall the server for long.  Pass ESP_OK to only
+ * count overruns.
+ *
+ * The handler receives the proxy, so it can send replies using Proxy::send() or close the connection with
+ * Proxy::close().  The reference must not be kept after the handler returns.  Connections using this proxy are
+ * never returned by Server::accept(), they stay open until the peer disconnects or the handler closes them.
+ *
+ * To write from elsewhere, e.g. from the main loop, pass an open_handler.  It's called on the server's task when
+ * a connection opens and gets a Client for writing to it, which can be kept for as long as needed.  Unlike Clients
+ * returned by Server::accept(), dropping it doesn't close the connection.  Once the connection is closed, the
+ * Client's connected() returns false and writes fail.
+ */
+class DirectDispatchProxy: public Proxy {
+    public:
+        typedef std::function<void(Proxy & proxy, const uint8_t * data, size_t size, httpd_ws_type_t type)> Handler;
+        typedef std::function<void(Client client)> OpenHandler;
+
+        DirectDispatchProxy(Handler handler, unsigned long time_budget_us = 10000, esp_err_t error_on_overrun = ESP_FAIL,
+                            esp_err_t error_on_no_memory = ESP_ERR_NO_MEM):
+            DirectDispatchProxy(nullptr, handler, time_budget_us, error_on_overrun, error_on_no_memory) {}
+
+        DirectDispatchProxy(OpenHandler open_handler, Handler handler, unsigned long time_budget_us = 10000,
+                            esp_err_t error_on_overrun = ESP_FAIL, esp_err_t error_on_no_memory = ESP_ERR_NO_MEM):
+            open_handler(open_handler), handler(handler), time_budget_us(time_budget_us),
+            error_on_overrun(error_on_overrun), error_on_no_memory(error_on_no_memory), buffer(nullptr),
+            buffer_size(0), dispatching(false), overruns(0), max_handler_time_us(0) {}
+
+        DirectDispatchProxy(const DirectDispatchProxy & other) = delete;
+        const DirectDispatchProxy & operator=(const DirectDispatchProxy & other) = delete;
+
+        ~DirectDispatchProxy() { free(buffer); }
+
+        virtual esp_err_t recv(httpd_req_t * request, httpd_ws_frame_t * frame) override {
+            std::unique_lock<std::mutex> lock(recv_mutex);
+
+            if (!connected()) {
+                return ESP_FAIL;
+            }
+
+            if (buffer_size < frame->len) {
+                // buffer too small for frame
+                char * new_buffer = (char *) realloc(buffer, frame->len);
+                if (!new_buffer) {
+                    // not enough memory to extend buffer
+                    return error_on_no_memory;
+                }
+                // buffer resized
+                buffer = new_buffer;
+                buffer_size = frame->len;
+            }
+
+            frame->payload = (uint8_t *)(buffer);
+            esp_err_t ret = httpd_ws_recv_frame(request, frame, frame->len);
+            if (ret != ESP_OK) {
+                ESP_LOGE(PH_TAG, "httpd_ws_recv_frame failed with %s", esp_err_to_name(ret));
+                return ret;
+            }
+
+            // The handler is called without holding the lock, so that it can call close().  The dispatching flag
+            // prevents discard() from freeing the buffer in the meantime.
+            dispatching = true;
+            lock.unlock();
+
+            const unsigned long start = micros();
+            handler(*this, frame->payload, frame->len, frame->type);
+            const unsigned long elapsed = micros() - start;
+
+            lock.lock();
+            dispatching = false;
+            if (!connected()) {
+                // closed by the handler, release the buffer now
+                free(buffer);
+                buffer = nullptr;
+                buffer_size = 0;
+            }
+            lock.unlock();
+
+            if (elapsed > max_handler_time_us) {
+                max_handler_time_us = elapsed;
+            }
+
+            if (elapsed > time_budget_us) {
+                ++overruns;
+                ESP_LOGW(PH_TAG, "Websocket handler took %lu us, budget is %lu us", elapsed, time_budget_us);
+                return error_on_overrun;
+            }
+
+            return ESP_OK;
+        }
+
+        virtual int available() override { return 0; }
+        virtual int read(uint8_t * ptr, size_t len) override { return 0; }
+        virtual int peek() override { return -1; }
+        virtual bool needs_accept() const override { return false; }
+
+        virtual void session_opened() override {
+            if (open_handler) {
+                open_handler(Client(this));
+            }
+        }
+
+        // number of handler calls, which exceeded the time budget
+        unsigned long get_overruns() const { return overruns; }
+
+        // longest handler call so far in microseconds
+        unsigned long get_max_handler_time_us() const { return max_handler_time_us; }
+
+        const OpenHandler open_handler;
+        const Handler handler;
+        const unsigned long time_budget_us;
+        const esp_err_t error_on_overrun;
+        const esp_err_t error_on_no_memory;
+
+    protected:
+        virtual void discard() override {
+            const std::lock_guard<std::mutex> lock(recv_mutex);
+            if (!dispatching) {
+                free(buffer);
+                buffer = nullptr;
+                buffer_size = 0;
+            }
+        }
+
+        virtual size_t buffered() override { return 0; }
+
+        char * buffer;
+        size_t buffer_size;
+        bool dispatching;
+
+        std::atomic<unsigned long> overruns;
+        std::atomic<unsigned long> max_handler_time_us;
+};
+
+}
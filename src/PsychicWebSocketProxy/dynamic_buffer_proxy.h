@@ -1,6 +1,5 @@
 #pragma once
 
-#include <condition_variable>
 #include <list>
 
 #include <Arduino.h>
@@ -19,15 +18,20 @@ namespace PsychicWebSocketProxy {
  *
  * This implementation is slow compared to others and can lead to significant RAM fragmentation.  It
  * can still be useful to reduce overall memory use and when connections are silent most of the time.
+ *
+ * Frames larger than max_size are rejected by default.  If spill_limit is set, a frame of up to
+ * spill_limit bytes is instead stored in a spill chunk allocated with the given heap capabilities
+ * (e.g. MALLOC_CAP_SPIRAM to use PSRAM).  The spill chunk doesn't count towards max_size, but only one
+ * can be queued at a time.  It's freed as soon as it's consumed, like any other chunk.
  */
 class DynamicBufferProxy: public Proxy {
     protected:
         struct Chunk {
-            Chunk(void * ptr, size_t size): size(size), buffer((char *) ptr) {}
-            Chunk(size_t size): size(size), buffer((char *) malloc(size)) {}
+            Chunk(void * ptr, size_t size, bool spill = false): size(size), buffer((char *) ptr), spill(spill) {}
+            Chunk(size_t size): size(size), buffer((char *) malloc(size)), spill(false) {}
             ~Chunk() { free(buffer); }
 
-            Chunk(Chunk && other): size(other.size), buffer(other.buffer) {
+            Chunk(Chunk && other): size(other.size), buffer(other.buffer), spill(other.spill) {
                 other.buffer = nullptr;
             }
 
@@ -36,16 +40,20 @@ class DynamicBufferProxy: public Proxy {
 
             char * buffer;
             const size_t size;
+            const bool spill;
         };
 
     public:
         DynamicBufferProxy(size_t max_size = 1024, unsigned long timeout_ms = 3000,
-                           esp_err_t error_on_no_memory = ESP_ERR_NO_MEM):
-            max_size(max_size), timeout(timeout_ms), error_on_no_memory(error_on_no_memory), offset(0) {}
+                           esp_err_t error_on_no_memory = ESP_ERR_NO_MEM, size_t spill_limit = 0,
+                           uint32_t spill_caps = MALLOC_CAP_8BIT):
+            max_size(max_size), timeout(timeout_ms), error_on_no_memory(error_on_no_memory),
+            spill_limit(spill_limit), spill_caps(spill_caps), offset(0), total_size(0), spill_size(0) {}
 
         virtual esp_err_t recv(httpd_req_t * request, httpd_ws_frame_t * frame) override {
             const size_t frame_size = frame->len;
-            if (frame_size > max_size) {
+            const bool spill = frame_size > max_size;
+            if (spill && (frame_size > spill_limit)) {
                 return error_on_no_memory;
             }
 
@@ -57,14 +65,22 @@ class DynamicBufferProxy: public Proxy {
             if (!cond.wait_for(
                         lock,
                         timeout,
-            [this, &ptr, frame_size]() -> bool {
-            size_t current_size = 0;
+            [this, &ptr, frame_size, spill]() -> bool {
+            if (!connected()) {
+                    return true;
+                }
 
-            for (const auto & chunk : buffer) {
-                    current_size += chunk.size;
+                if (spill) {
+                    if (spill_size) {
+                        // previous spill chunk not consumed yet
+                        return false;
+                    }
+                    ptr = heap_caps_malloc(frame_size, spill_caps);
+                    return ptr;
                 }
 
-                if (current_size + frame_size > max_size) {
+                // the spill chunk doesn't count towards max_size
+                if (total_size - spill_size + frame_size > max_size) {
                     return false;
                 }
 
@@ -75,7 +91,12 @@ class DynamicBufferProxy: public Proxy {
                 return error_on_no_memory;
             }
 
-            Chunk chunk(ptr, frame_size);
+            if (!ptr) {
+                // connection closed while waiting
+                return ESP_FAIL;
+            }
+
+            Chunk chunk(ptr, frame_size, spill);
 
             frame->payload = (uint8_t *)(chunk.buffer);
             esp_err_t ret = httpd_ws_recv_frame(request, frame, frame->len);
@@ -84,19 +105,15 @@ class DynamicBufferProxy: public Proxy {
                 ESP_LOGE(PH_TAG, "httpd_ws_recv_frame failed with %s", esp_err_to_name(ret));
             } else {
                 buffer.push_back(std::move(chunk));
+                total_size += frame_size;
+                if (spill) {
+                    spill_size = frame_size;
+                }
+                data_changed();
             }
             return ret;
         }
 
-        virtual int available() {
-            const std::lock_guard<std::mutex> lock(recv_mutex);
-            size_t ret = 0;
-            for (const auto & chunk : buffer) {
-                ret += chunk.size;
-            }
-            return ret - offset;
-        }
-
         virtual int read(uint8_t * ptr, size_t len) {
             const std::lock_guard<std::mutex> lock(recv_mutex);
 
@@ -114,12 +131,16 @@ class DynamicBufferProxy: public Proxy {
 
                 if (offset >= chunk.size) {
                     // end of chunk reached, free it
+                    if (chunk.spill) {
+                        spill_size = 0;
+                    }
+                    total_size -= chunk.size;
                     buffer.pop_front();
                     offset = 0;
-                    cond.notify_all();
                 }
             }
 
+            data_changed();
             return write_ptr - ptr;
         }
 
@@ -135,13 +156,25 @@ class DynamicBufferProxy: public Proxy {
         const size_t max_size;
         const std::chrono::milliseconds timeout;
         const esp_err_t error_on_no_memory;
+        const size_t spill_limit;
+        const uint32_t spill_caps;
 
     protected:
-        std::mutex recv_mutex;
-        std::condition_variable cond;
+        virtual void discard() override {
+            const std::lock_guard<std::mutex> lock(recv_mutex);
+            buffer.clear();
+            offset = 0;
+            total_size = 0;
+            spill_size = 0;
+        }
+
+        virtual size_t buffered() override { return total_size - offset; }
 
         std::list<Chunk> buffer;
         size_t offset;
+        // total size of all queued chunks, kept up to date so that buffered() doesn't have to walk the list
+        size_t total_size;
+        size_t spill_size;
 };
 
 }
@@ -0,0 +1,184 @@
+#pragma once
+
+#include <Arduino.h>
+
+#include "proxy.h"
+
+namespace PsychicWebSocketProxy {
+
+/* This proxy works like SingleFrameProxy, but it can hold up to slot_count frames instead of just one.  Each slot
+ * has its own buffer, which is allocated and grown on demand to fit the largest frame stored in it.  The slots are
+ * used in a ring: received frames are written to the slot after the last filled one and read from the first filled
+ * one.
+ *
+ * With SingleFrameProxy, the server's task can't receive the next frame until the previous one is fully consumed.
+ * Here, it only blocks when all slots are full, so short bursts of frames don't stall the connection even if the
+ * data is consumed with some delay.  The frame is received into a free slot without holding the lock, so reading
+ * the already queued frames isn't blocked while a frame is being transferred.
+ *
+ * Frames larger than max_frame_size bytes are rejected (0 means no limit).  Memory use is therefore limited to
+ * slot_count * max_frame_size bytes.  Slot buffers are kept after the frame is consumed and reused for later
+ * frames, they're only freed when the connection is closed.
+ */
+class FrameQueueProxy: public Proxy {
+    protected:
+        struct Slot {
+            Slot(): buffer(nullptr), buffer_size(0), frame_size(0) {}
+            ~Slot() { free(buffer); }
+
+            void release() {
+                free(buffer);
+                buffer = nullptr;
+                buffer_size = 0;
+                frame_size = 0;
+            }
+
+            char * buffer;
+            size_t buffer_size;
+            size_t frame_size;
+        };
+
+    public:
+        FrameQueueProxy(size_t slot_count = 4, size_t max_frame_size = 0, unsigned long timeout_ms = 3000,
+                        esp_err_t error_on_no_memory = ESP_ERR_NO_MEM):
+            slot_count(slot_count ? slot_count : 1), max_frame_size(max_frame_size), timeout(timeout_ms),
+            error_on_no_memory(error_on_no_memory), slots(new Slot[this->slot_count]), receiving(nullptr),
+            first(0), filled(0), read_offset(0), queued_size(0) {}
+
+        FrameQueueProxy(const FrameQueueProxy & other) = delete;
+        const FrameQueueProxy & operator=(const FrameQueueProxy & other) = delete;
+
+        ~FrameQueueProxy() { delete[] slots; }
+
+        virtual esp_err_t recv(httpd_req_t * request, httpd_ws_frame_t * frame) override {
+            const size_t frame_size = frame->len;
+
+            if (max_frame_size && (frame_size > max_frame_size)) {
+                // the frame will never fit
+                return error_on_no_memory;
+            }
+
+            std::unique_lock<std::mutex> lock(recv_mutex);
+            if (!cond.wait_for(
+                        lock,
+                        timeout,
+            [this]() -> bool {
+            return (filled < slot_count) || !connected();
+            })) {
+                // all slots full
+                return error_on_no_memory;
+            }
+
+            if (!connected()) {
+                // connection closed while waiting, buffers are already gone
+                return ESP_FAIL;
+            }
+
+            Slot & slot = slots[(first + filled) % slot_count];
+
+            if (slot.buffer_size < frame_size) {
+                // slot buffer too small for frame
+                char * new_buffer = (char *) realloc(slot.buffer, frame_size);
+                if (!new_buffer) {
+                    // not enough memory to extend buffer
+                    return error_on_no_memory;
+                }
+                // buffer resized
+                slot.buffer = new_buffer;
+                slot.buffer_size = frame_size;
+            }
+
+            // The slot is not visible to the reader until it's marked as filled, so the frame can be received without
+            // holding the lock.  The receiving pointer prevents discard() from freeing the slot's buffer meanwhile.
+            receiving = &slot;
+            lock.unlock();
+
+            frame->payload = (uint8_t *)(slot.buffer);
+            esp_err_t ret = httpd_ws_recv_frame(request, frame, frame_size);
+
+            lock.lock();
+            receiving = nullptr;
+
+            if (!connected()) {
+                // closed while receiving, release the buffer now
+                slot.release();
+                return ESP_FAIL;
+            }
+
+            if (ret != ESP_OK) {
+                ESP_LOGE(PH_TAG, "httpd_ws_recv_frame failed with %s", esp_err_to_name(ret));
+            } else {
+                slot.frame_size = frame_size;
+                ++filled;
+                queued_size += frame_size;
+                data_changed();
+            }
+
+            return ret;
+        }
+
+        virtual int read(uint8_t * ptr, size_t len) override {
+            const std::lock_guard<std::mutex> lock(recv_mutex);
+
+            uint8_t * write_ptr = ptr;
+
+            while (len && filled) {
+                Slot & slot = slots[first];
+                const size_t bytes_available = slot.frame_size - read_offset;
+                const size_t bytes_to_read = len < bytes_available ? len : bytes_available;
+
+                memcpy(write_ptr, slot.buffer + read_offset, bytes_to_read);
+                read_offset += bytes_to_read;
+                write_ptr += bytes_to_read;
+                len -= bytes_to_read;
+
+                if (read_offset >= slot.frame_size) {
+                    // frame consumed, the slot is free again
+                    queued_size -= slot.frame_size;
+                    slot.frame_size = 0;
+                    first = (first + 1) % slot_count;
+                    --filled;
+                    read_offset = 0;
+                }
+            }
+
+            data_changed();
+            return write_ptr - ptr;
+        }
+
+        virtual int peek() override {
+            const std::lock_guard<std::mutex> lock(recv_mutex);
+            return filled ? ((unsigned char *) slots[first].buffer)[read_offset] : -1;
+        }
+
+        const size_t slot_count;
+        const size_t max_frame_size;
+        const std::chrono::milliseconds timeout;
+        const esp_err_t error_on_no_memory;
+
+    protected:
+        virtual void discard() override {
+            const std::lock_guard<std::mutex> lock(recv_mutex);
+            for (size_t i = 0; i < slot_count; ++i) {
+                if (&slots[i] != receiving) {
+                    slots[i].release();
+                }
+            }
+            first = 0;
+            filled = 0;
+            read_offset = 0;
+            queued_size = 0;
+        }
+
+        virtual size_t buffered() override { return queued_size - read_offset; }
+
+        Slot * const slots;
+        Slot * receiving;
+
+        size_t first;
+        size_t filled;
+        size_t read_offset;
+        size_t queued_size;
+};
+
+}
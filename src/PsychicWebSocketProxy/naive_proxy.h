@@ -18,6 +18,10 @@ class NaiveProxy: public Proxy {
 
         virtual esp_err_t recv(httpd_req_t * request, httpd_ws_frame_t * frame) override {
             const std::lock_guard<std::mutex> lock(recv_mutex);
+            if (!connected()) {
+                // connection closed, don't grow the buffer anymore
+                return ESP_FAIL;
+            }
             char * new_buffer = (char *) realloc(buffer, size + frame->len);
             if (!new_buffer) {
                 return ESP_ERR_NO_MEM;
@@ -33,15 +37,11 @@ class NaiveProxy: public Proxy {
                 // retrived using the read() method, without returning uninitialized data.
             } else {
                 size += frame->len;
+                data_changed();
             }
             return ret;
         }
 
-        virtual int available() {
-            const std::lock_guard<std::mutex> lock(recv_mutex);
-            return size;
-        }
-
         virtual int read(uint8_t * ptr, size_t len) {
             const std::lock_guard<std::mutex> lock(recv_mutex);
             const size_t bytes_to_read = len < size ? len : size;
@@ -50,6 +50,7 @@ class NaiveProxy: public Proxy {
                 size -= bytes_to_read;
                 memmove(buffer, buffer + bytes_to_read, size);
                 buffer = (char *) realloc(buffer, size);
+                data_changed();
             }
             return bytes_to_read;
         }
@@ -60,7 +61,15 @@ class NaiveProxy: public Proxy {
         }
 
     protected:
-        std::mutex recv_mutex;
+        virtual void discard() override {
+            const std::lock_guard<std::mutex> lock(recv_mutex);
+            free(buffer);
+            buffer = nullptr;
+            size = 0;
+        }
+
+        virtual size_t buffered() override { return size; }
+
         char * buffer;
         size_t size;
 };
@@ -1,22 +1,88 @@
 #pragma once
+#include <algorithm>
+#include <atomic>
+#include <chrono>
+#include <condition_variable>
+#include <functional>
 #include <mutex>
 
 #include <PsychicHttp.h>
 
+#include "tracer.h"
+
 namespace PsychicWebSocketProxy {
 
+// A piece of a message to send, see Proxy::send(const Segment *, size_t)
+struct Segment {
+    const void * data;
+    size_t size;
+};
+
 class Proxy {
     public:
-        Proxy(): psychic_client(nullptr) {}
+        Proxy(): available_bytes(0), is_connected(false), psychic_client(nullptr), send_buffer(nullptr),
+            send_buffer_size(0), callback_armed(false), tracer(nullptr), trace_id(0), references(0),
+            next_waiting(nullptr), waiting_since_us(0), poll_available(false) {}
 
         Proxy(const Proxy & other) = delete;
         const Proxy & operator=(const Proxy & other) = delete;
 
-        virtual ~Proxy() {}
+        virtual ~Proxy() { free(send_buffer); }
+
+        /* Proxy objects are reference counted.  Each Client object holds one reference and the Server holds
+         * server_reference references as long as the websocket session is open.  The proxy deletes itself when the
+         * last reference is dropped.  Counting both in a single atomic keeps the per-connection bookkeeping in one
+         * allocation and lets the server's task use the proxy without touching the counter at all.
+         *
+         * Dropping the last Client closes the session, unless the proxy doesn't need accept() (see needs_accept()).
+         * Such connections belong to the session, Clients only borrow them.
+         */
+        static const unsigned int server_reference = 0x10000;
+
+        void acquire() { references.fetch_add(1, std::memory_order_relaxed); }
+
+        void release() {
+            unsigned int count = references.load(std::memory_order_acquire);
+            while ((count != server_reference + 1) || !needs_accept()) {
+                // Other Client objects exist or the session is gone, just drop our reference.  This must be a single
+                // compare-and-swap, otherwise two Clients released at the same time could both see the other one
+                // still alive and neither would close the session.
+                if (references.compare_exchange_weak(count, count - 1, std::memory_order_acq_rel,
+                                                     std::memory_order_acquire)) {
+                    if (count == 1) {
+                        delete this;
+                    }
+                    return;
+                }
+            }
+
+            // This is the last Client object, but the session is still open.  Nobody will ever read the data received
+            // from now on, so close the connection.  It's safe to call close() here, because our own reference keeps
+            // the object alive and no new Client objects can be created without one.
+            close();
+            if (references.fetch_sub(1, std::memory_order_acq_rel) == 1) {
+                delete this;
+            }
+        }
+
+        void attach() { references.fetch_add(server_reference, std::memory_order_relaxed); }
+
+        void detach() {
+            if (references.fetch_sub(server_reference, std::memory_order_acq_rel) == server_reference) {
+                delete this;
+            }
+        }
 
         void set_websocket_client(PsychicWebSocketClient * psychic_client) {
-            const std::lock_guard<std::mutex> lock(send_mutex);
-            this->psychic_client = psychic_client;
+            {
+                const std::lock_guard<std::mutex> lock(send_mutex);
+                this->psychic_client = psychic_client;
+                is_connected.store(psychic_client, std::memory_order_release);
+            }
+            if (!psychic_client) {
+                notify_state_change();
+                notify_receive();
+            }
         }
 
         size_t send(const void * buf, const size_t len) {
@@ -28,24 +94,252 @@ class Proxy {
             }
         }
 
-        virtual uint8_t connected() {
+        /* Send multiple segments of data as a single websocket frame.  Unless there's just one segment, the data is
+         * copied into a send buffer first.  The buffer is reused by subsequent calls, so after it has grown to the
+         * size of the largest message, no more allocations are needed.  It stays at that size until the connection
+         * is closed or release_send_buffer() is called.  Returns the number of bytes sent, which is either the total
+         * size of all segments or 0 on error.  Nothing is sent if there are no segments.
+         */
+        size_t send(const Segment * segments, size_t count) {
+            if (!count) {
+                return 0;
+            }
+
+            if (count == 1) {
+                return send(segments[0].data, segments[0].size);
+            }
+
+            size_t len = 0;
+            for (size_t i = 0; i < count; ++i) {
+                len += segments[i].size;
+            }
+
+            const std::lock_guard<std::mutex> lock(send_mutex);
+            if (!psychic_client) {
+                return 0;
+            }
+
+            if (send_buffer_size < len) {
+                char * new_buffer = (char *) realloc(send_buffer, len);
+                if (!new_buffer) {
+                    return 0;
+                }
+                send_buffer = new_buffer;
+                send_buffer_size = len;
+            }
+
+            char * ptr = send_buffer;
+            for (size_t i = 0; i < count; ++i) {
+                memcpy(ptr, segments[i].data, segments[i].size);
+                ptr += segments[i].size;
+            }
+
+            return (psychic_client->sendMessage(HTTPD_WS_TYPE_BINARY, send_buffer, len) == ESP_OK) ? len : 0;
+        }
+
+        // Free the buffer used by send(const Segment *, size_t), e.g. after sending an unusually large message
+        void release_send_buffer() {
+            const std::lock_guard<std::mutex> lock(send_mutex);
+            free(send_buffer);
+            send_buffer = nullptr;
+            send_buffer_size = 0;
+        }
+
+        // Send a control frame (PING, PONG or CLOSE), returns false if the connection is closed or the frame can't be
+        // sent.  Control frame payloads are limited to 125 bytes.
+        bool send_control(httpd_ws_type_t type, const void * payload = nullptr, size_t len = 0) {
             const std::lock_guard<std::mutex> lock(send_mutex);
-            // The psychic_client is set to NULL when the connection managed by PsychicHttp dies.
-            // As long as it's not NULL, we're connected.
-            return bool(psychic_client);
+            return psychic_client && (psychic_client->sendMessage(type, payload, len) == ESP_OK);
+        }
+
+        bool ping() { return send_control(HTTPD_WS_TYPE_PING); }
+
+        virtual uint8_t connected() {
+            // The psychic_client is set to NULL when the connection managed by PsychicHttp dies.  As long as it's not
+            // NULL, we're connected.  is_connected mirrors that, so we don't need to take send_mutex here.
+            return is_connected.load(std::memory_order_acquire);
+        }
+
+        // Close the websocket session and release the receive buffers right away.  If status_code is not 0, a close
+        // frame with the given status code is sent to the peer first.  After this, connected() returns false, all
+        // buffered data is dropped and further frames are rejected.
+        void close(uint16_t status_code = 1000) {
+            {
+                const std::lock_guard<std::mutex> lock(send_mutex);
+                if (psychic_client) {
+                    if (status_code) {
+                        const uint8_t payload[] = { uint8_t(status_code >> 8), uint8_t(status_code & 0xff) };
+                        psychic_client->sendMessage(HTTPD_WS_TYPE_CLOSE, payload, sizeof(payload));
+                    }
+                    // this only schedules the close, the session is torn down by the server's task
+                    psychic_client->close();
+                    psychic_client = nullptr;
+                    is_connected.store(false, std::memory_order_release);
+                }
+                free(send_buffer);
+                send_buffer = nullptr;
+                send_buffer_size = 0;
+            }
+            discard();
+            notify_state_change();
+            notify_receive();
+        }
+
+        /* Register a one-shot callback, which gets called the next time data is received or when the connection
+         * drops.  The callback is called from the server's task, so it must return quickly and it must not call
+         * back into the proxy.  Registering a new callback replaces the previous one.
+         */
+        void set_receive_callback(std::function<void()> callback) {
+            const std::lock_guard<std::mutex> lock(callback_mutex);
+            receive_callback = std::move(callback);
+            callback_armed.store(bool(receive_callback), std::memory_order_relaxed);
+            // Pairs with the fence in notify_receive().  Either the caller's next available() or connected() call sees
+            // the new state or notify_receive() sees the callback.
+            std::atomic_thread_fence(std::memory_order_seq_cst);
+        }
+
+        // Unregister the receive callback.  Returns false if there was no callback registered, e.g. because it has
+        // already been called.
+        bool cancel_receive_callback() {
+            const std::lock_guard<std::mutex> lock(callback_mutex);
+            if (!receive_callback) {
+                return false;
+            }
+            receive_callback = nullptr;
+            callback_armed.store(false, std::memory_order_relaxed);
+            return true;
+        }
+
+        // this is called by the server after recv() stores new data
+        void notify_receive() {
+            // This runs for every frame, so skip the lock unless a callback is registered.
+            std::atomic_thread_fence(std::memory_order_seq_cst);
+            if (!callback_armed.load(std::memory_order_relaxed)) {
+                return;
+            }
+            std::function<void()> callback;
+            {
+                const std::lock_guard<std::mutex> lock(callback_mutex);
+                if (!receive_callback) {
+                    return;
+                }
+                std::swap(callback, receive_callback);
+                callback_armed.store(false, std::memory_order_relaxed);
+            }
+            callback();
+        }
+
+        // Assign a tracer to record this connection's traffic.  This must be called before the connection is used.
+        void set_tracer(FrameTracer * tracer) {
+            this->tracer = tracer;
+            trace_id = tracer ? tracer->next_connection_id() : 0;
+        }
+
+        bool tracing() const { return tracer; }
+
+        void trace(FrameTracer::Event event, uint8_t type = 0, uint32_t a = 0, uint32_t b = 0) {
+            if (tracer) {
+                tracer->record(event, trace_id, type, a, b);
+            }
         }
 
         // this iss called from the event loop running the server
         virtual esp_err_t recv(httpd_req_t * request, httpd_ws_frame_t * frame) = 0;
 
         // these are called from the main loop
-        virtual int available() = 0;
+        virtual int available() {
+            // This is called very often, so it's served from an atomic copy of buffered() instead of taking the lock.
+            return available_bytes.load(std::memory_order_acquire);
+        }
+
+        /* Wait until there's data to read or the connection drops, but no longer than timeout_ms.  The calling
+         * thread sleeps on a condition variable, which is signalled when recv() stores new data.  Proxies, which
+         * don't signal it (see buffered()), are polled every millisecond instead.  Returns true if there's data
+         * available.
+         */
+        bool wait_available(unsigned long timeout_ms) {
+            std::unique_lock<std::mutex> lock(recv_mutex);
+            const auto deadline = std::chrono::steady_clock::now() + std::chrono::milliseconds(timeout_ms);
+            while (!buffered() && connected()) {
+                const auto now = std::chrono::steady_clock::now();
+                if (now >= deadline) {
+                    break;
+                }
+                const auto poll = now + std::chrono::milliseconds(1);
+                cond.wait_until(lock, poll_available ? std::min(deadline, poll) : deadline);
+            }
+            return buffered();
+        }
+
         virtual int read(uint8_t * buffer, size_t size) = 0;
         virtual int peek() = 0;
 
+        // Whether connections using this proxy are queued for Server::accept().  Proxies, which hand the received
+        // data to someone else, return false, so that their connections don't wait for a Client nobody will create.
+        virtual bool needs_accept() const { return true; }
+
+        // Called on the server's task once the session is set up, only for proxies, which don't need accept()
+        virtual void session_opened() {}
+
     protected:
+        friend class Server;
+
+        // this drops all buffered data and frees receive buffers, it's called after the connection is closed
+        virtual void discard() {}
+
+        /* This returns the number of bytes ready to read, it's called with recv_mutex locked.  Proxies must override
+         * it and call data_changed() whenever they store or consume data.  Proxies written before this existed
+         * override available() instead and never call data_changed().  For them, the default falls back to
+         * available() and makes wait_available() poll.
+         */
+        virtual size_t buffered() {
+            poll_available = true;
+            return available();
+        }
+
+        // this must be called with recv_mutex locked after data is stored or consumed
+        void data_changed() {
+            available_bytes.store(buffered(), std::memory_order_release);
+            cond.notify_all();
+        }
+
+        // wake up threads waiting on cond after the connection state changed
+        void notify_state_change() {
+            // Locking the mutex guarantees that waiting threads either haven't checked the connection state yet or
+            // are already waiting and will receive the notification.
+            const std::lock_guard<std::mutex> lock(recv_mutex);
+            data_changed();
+        }
+
+        // recv_mutex protects the receive buffers, cond is notified whenever data is stored or consumed
+        std::mutex recv_mutex;
+        std::condition_variable cond;
+
+        // lock-free copies of buffered() and the connection state for available() and connected()
+        std::atomic<size_t> available_bytes;
+        std::atomic<bool> is_connected;
+
         std::mutex send_mutex;
         PsychicWebSocketClient * psychic_client;
+        char * send_buffer;
+        size_t send_buffer_size;
+
+        // callback_armed is set while receive_callback is registered, so notify_receive() can skip callback_mutex
+        std::mutex callback_mutex;
+        std::function<void()> receive_callback;
+        std::atomic<bool> callback_armed;
+
+        FrameTracer * tracer;
+        uint16_t trace_id;
+
+        std::atomic<unsigned int> references;
+
+        // used by Server to queue connections waiting for accept()
+        Proxy * next_waiting;
+        unsigned long waiting_since_us;
+
+        // set by the default buffered(), only accessed with recv_mutex locked
+        bool poll_available;
 };
 
 }
@@ -0,0 +1,49 @@
+#pragma once
+
+#include <Arduino.h>
+
+namespace PsychicWebSocketProxy {
+
+/* Token bucket used to limit the rate of incoming traffic.  The bucket is refilled with rate tokens per second and
+ * holds at most one second worth of tokens.  Consuming is allowed as long as the bucket isn't empty, even if that
+ * makes the balance negative -- the following frames then have to wait until the debt is paid off.  Amounts larger
+ * than the bucket don't fit at all (see fits()), which keeps the debt, and so the wait, under one second.  A bucket
+ * with rate 0 is disabled and never runs empty.
+ */
+class TokenBucket {
+    public:
+        TokenBucket(uint32_t rate = 0): rate(rate), tokens(rate), last_update(micros()) {}
+
+        bool enabled() const { return rate; }
+
+        void update(unsigned long now_us) {
+            if (rate) {
+                tokens += float(now_us - last_update) * rate / 1000000.0f;
+                if (tokens > rate) {
+                    tokens = rate;
+                }
+            }
+            last_update = now_us;
+        }
+
+        bool empty() const { return rate && (tokens <= 0); }
+
+        // whether amount is within the bucket's capacity
+        bool fits(uint32_t amount) const { return !rate || (amount <= rate); }
+
+        void consume(uint32_t amount) {
+            if (rate) {
+                tokens -= amount;
+            }
+        }
+
+        // milliseconds until the bucket stops being empty
+        unsigned long wait_time_ms() const { return empty() ? (unsigned long)(-tokens * 1000.0f / rate) + 1 : 0; }
+
+    protected:
+        uint32_t rate;
+        float tokens;
+        unsigned long last_update;
+};
+
+}
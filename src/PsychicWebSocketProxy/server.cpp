@@ -2,27 +2,67 @@
 
 namespace PsychicWebSocketProxy {
 
-Server::PsychicWebSocketClientProxy::PsychicWebSocketClientProxy(PsychicClient * client,
-        const std::shared_ptr<Proxy> & proxy):
+Server::PsychicWebSocketClientProxy::PsychicWebSocketClientProxy(PsychicClient * client, Proxy * proxy):
     PsychicWebSocketClient(client),
-    proxy(proxy) {
+    proxy(proxy), missed_pongs(0), throttled_frames(0) {
+    proxy->attach();
     proxy->set_websocket_client(this);
 }
 
 Server::PsychicWebSocketClientProxy::~PsychicWebSocketClientProxy() {
-    const std::shared_ptr<Proxy> ptr = proxy.lock();
-    if (ptr) {
-        ptr->set_websocket_client(nullptr);
-    }
+    proxy->set_websocket_client(nullptr);
+    proxy->detach();
 }
 
-Server::Server(std::function<Proxy *()> proxy_factory) : proxy_factory(proxy_factory) {}
+Server::Server(std::function<Proxy *()> proxy_factory) : waiting_head(nullptr), waiting_tail(nullptr),
+    proxy_factory(proxy_factory), tracer(nullptr), httpd(nullptr), keepalive_timer(nullptr),
+    keepalive_max_missed_pongs(0), keepalive_closes(0), keepalive_pending(false), keepalive_stopping(false),
+    rate_limit_bytes_per_second(0),
+    rate_limit_frames_per_second(0), rate_limit_action(RATE_LIMIT_DELAY), throttled_frames(0),
+    connections_opened(0), connections_accepted(0), connections_closed(0), frames_received(0), bytes_received(0),
+    recv_errors(0), max_accept_latency_us(0) {}
+
+Server::~Server() {
+    if (keepalive_timer) {
+        esp_timer_stop(keepalive_timer);
+        {
+            // a timer callback already in progress won't queue any more work after this
+            const std::lock_guard<std::mutex> lock(keepalive_mutex);
+            keepalive_stopping = true;
+        }
+        esp_timer_delete(keepalive_timer);
+
+        // keepalive_work() may already be queued on the server's task, it must not run after we're gone
+        std::unique_lock<std::mutex> lock(keepalive_mutex);
+        keepalive_cond.wait(lock, [this] { return !keepalive_pending; });
+    }
+
+    const std::lock_guard<std::mutex> lock(accept_mutex);
+    while (waiting_head) {
+        Proxy * proxy = waiting_head;
+        waiting_head = proxy->next_waiting;
+        proxy->release();
+    }
+    waiting_tail = nullptr;
+}
 
 Client Server::accept() {
     const std::lock_guard<std::mutex> lock(accept_mutex);
-    if (!waiting_clients.empty()) {
-        auto ret = waiting_clients.front();
-        waiting_clients.pop_front();
+    if (waiting_head) {
+        Proxy * proxy = waiting_head;
+        waiting_head = proxy->next_waiting;
+        if (!waiting_head) {
+            waiting_tail = nullptr;
+        }
+        proxy->next_waiting = nullptr;
+        const unsigned long latency = micros() - proxy->waiting_since_us;
+        if (latency > max_accept_latency_us) {
+            max_accept_latency_us = latency;
+        }
+        ++connections_accepted;
+        // hand over the queue's reference to the returned Client
+        Client ret(proxy);
+        proxy->release();
         return ret;
     } else {
         return Client(nullptr);
@@ -30,17 +70,184 @@ Client Server::accept() {
 }
 
 void Server::addClient(PsychicClient * client) {
-    const std::shared_ptr<Proxy> proxy(proxy_factory());
-    client->_friend = new PsychicWebSocketClientProxy(client, proxy);
+    httpd.store(client->server());
+    Proxy * proxy = proxy_factory();
+    proxy->set_tracer(tracer);
+    proxy->trace(FrameTracer::OPEN);
+    PsychicWebSocketClientProxy * pwscp = new PsychicWebSocketClientProxy(client, proxy);
+    pwscp->byte_bucket = TokenBucket(rate_limit_bytes_per_second);
+    pwscp->frame_bucket = TokenBucket(rate_limit_frames_per_second);
+    client->_friend = pwscp;
     PsychicHandler::addClient(client);
+    ++connections_opened;
+    if (!proxy->needs_accept()) {
+        // nobody will accept this connection, it's kept alive by the session alone
+        proxy->session_opened();
+        return;
+    }
+    // the accept queue holds a reference until the connection is accepted
+    proxy->acquire();
     const std::lock_guard<std::mutex> lock(accept_mutex);
-    waiting_clients.push_back(Client(proxy));
+    proxy->waiting_since_us = micros();
+    if (waiting_tail) {
+        waiting_tail->next_waiting = proxy;
+    } else {
+        waiting_head = proxy;
+    }
+    waiting_tail = proxy;
 }
 
 void Server::removeClient(PsychicClient * client) {
     PsychicHandler::removeClient(client);
-    delete (PsychicWebSocketClientProxy *)(client->_friend);
+    PsychicWebSocketClientProxy * pwscp = (PsychicWebSocketClientProxy *)(client->_friend);
+    pwscp->proxy->trace(FrameTracer::CLOSE);
+    delete pwscp;
     client->_friend = nullptr;
+    ++connections_closed;
+}
+
+Server::Stats Server::get_stats() const {
+    Stats stats;
+    stats.connections_opened = connections_opened;
+    stats.connections_accepted = connections_accepted;
+    stats.connections_closed = connections_closed;
+    stats.frames_received = frames_received;
+    stats.bytes_received = bytes_received;
+    stats.recv_errors = recv_errors;
+    stats.max_accept_latency_us = max_accept_latency_us;
+    return stats;
+}
+
+void Server::set_keepalive(unsigned long interval_ms, unsigned int max_missed_pongs) {
+    keepalive_max_missed_pongs = max_missed_pongs;
+
+    if (!keepalive_timer) {
+        const esp_timer_create_args_t args = {
+            .callback = keepalive_timer_callback,
+            .arg = this,
+            .dispatch_method = ESP_TIMER_TASK,
+            .name = "ws_keepalive",
+            .skip_unhandled_events = true,
+        };
+        const esp_err_t ret = esp_timer_create(&args, &keepalive_timer);
+        if (ret != ESP_OK) {
+            ESP_LOGE(PH_TAG, "esp_timer_create failed with %s", esp_err_to_name(ret));
+            keepalive_timer = nullptr;
+            return;
+        }
+    } else {
+        esp_timer_stop(keepalive_timer);
+    }
+
+    if (interval_ms) {
+        esp_timer_start_periodic(keepalive_timer, uint64_t(interval_ms) * 1000);
+    }
+}
+
+void Server::keepalive_timer_callback(void * arg) {
+    Server * server = (Server *) arg;
+    const httpd_handle_t httpd = server->httpd;
+    const std::lock_guard<std::mutex> lock(server->keepalive_mutex);
+    if (!httpd || server->keepalive_stopping || server->keepalive_pending) {
+        // not connected yet, shutting down or the previous check hasn't run yet
+        return;
+    }
+    // The client list can only be accessed safely from the server's task
+    server->keepalive_pending = (httpd_queue_work(httpd, keepalive_work, server) == ESP_OK);
+}
+
+void Server::keepalive_work(void * arg) {
+    Server * server = (Server *) arg;
+    bool stopping;
+    {
+        const std::lock_guard<std::mutex> lock(server->keepalive_mutex);
+        stopping = server->keepalive_stopping;
+    }
+    if (!stopping) {
+        server->check_keepalive();
+    }
+    // the destructor may proceed as soon as keepalive_pending is cleared, so don't touch the server afterwards
+    const std::lock_guard<std::mutex> lock(server->keepalive_mutex);
+    server->keepalive_pending = false;
+    server->keepalive_cond.notify_all();
+}
+
+void Server::check_keepalive() {
+    const unsigned int max_missed_pongs = keepalive_max_missed_pongs;
+    for (PsychicClient * client : _clients) {
+        PsychicWebSocketClientProxy * pwscp = (PsychicWebSocketClientProxy *)(client->_friend);
+        if (!pwscp || !pwscp->proxy->connected()) {
+            // already closing
+            continue;
+        }
+
+        if ((max_missed_pongs && (pwscp->missed_pongs >= max_missed_pongs)) || !pwscp->proxy->ping()) {
+            ESP_LOGW(PH_TAG, "Closing unresponsive websocket connection (socket %i)", pwscp->socket());
+            ++keepalive_closes;
+            pwscp->proxy->close(0);
+        } else {
+            ++pwscp->missed_pongs;
+        }
+    }
+}
+
+void Server::set_rate_limit(uint32_t bytes_per_second, uint32_t frames_per_second, RateLimitAction action) {
+    rate_limit_bytes_per_second = bytes_per_second;
+    rate_limit_frames_per_second = frames_per_second;
+    rate_limit_action = action;
+}
+
+esp_err_t Server::drop_frame(httpd_req_t * request, httpd_ws_frame_t * frame) {
+    if (!frame->len) {
+        return ESP_OK;
+    }
+
+    // The frame must be read from the socket even if we don't want it, otherwise its payload would be interpreted as
+    // the next frame.  ESP-IDF can't read a frame in parts, so it must fit in drop_buffer.  The length is controlled
+    // by the peer, so allocating a buffer for it isn't an option.
+    if (frame->len > sizeof(drop_buffer)) {
+        return ESP_ERR_INVALID_SIZE;
+    }
+    frame->payload = drop_buffer;
+    const esp_err_t ret = httpd_ws_recv_frame(request, frame, frame->len);
+    frame->payload = nullptr;
+    return ret;
+}
+
+esp_err_t Server::handle_control_frame(PsychicWebSocketClientProxy * pwscp, httpd_req_t * request,
+                                      httpd_ws_frame_t * frame) {
+    // Control frames only get here if the endpoint handles them, otherwise ESP-IDF takes care of them.  They can carry
+    // up to 125 bytes of payload, which must be consumed.
+    uint8_t payload[125];
+    if (frame->len > sizeof(payload)) {
+        // protocol violation
+        return ESP_FAIL;
+    } else if (frame->len) {
+        frame->payload = payload;
+        const esp_err_t ret = httpd_ws_recv_frame(request, frame, frame->len);
+        frame->payload = nullptr;
+        if (ret != ESP_OK) {
+            return ret;
+        }
+    }
+
+    switch (frame->type) {
+        case HTTPD_WS_TYPE_PING:
+            // the PONG must carry the PING's payload
+            pwscp->proxy->send_control(HTTPD_WS_TYPE_PONG, payload, frame->len);
+            return ESP_OK;
+        case HTTPD_WS_TYPE_CLOSE: {
+            // Echo the status code and close the session.  Unlike Proxy::close(), this keeps the data received so
+            // far, so the reader still gets it, like when the peer disconnects.
+            const uint8_t normal_closure[] = { 1000 >> 8, 1000 & 0xff };
+            pwscp->proxy->send_control(HTTPD_WS_TYPE_CLOSE, (frame->len >= 2) ? payload : normal_closure, 2);
+            pwscp->close();
+            return ESP_OK;
+        }
+        default:
+            // PONGs only prove that the peer is alive
+            return ESP_OK;
+    }
 }
 
 esp_err_t Server::handleRequest(PsychicRequest * request) {
@@ -61,9 +268,11 @@ esp_err_t Server::handleRequest(PsychicRequest * request) {
     PsychicWebSocketClientProxy * pwscp = reinterpret_cast<PsychicWebSocketClientProxy *>
                                           (PsychicWebSocketHandler::getClient(wsRequest.client()));
 
-    const std::shared_ptr<Proxy> ptr = pwscp->proxy.lock();
-    if (!ptr) {
-        // The synchronous client abandoned the connection
+    // NOTE: The server holds a reference to the proxy until removeClient() is called, so it's safe to use it here
+    // without touching the reference counter.
+    Proxy * const ptr = pwscp->proxy;
+    if (!ptr->connected()) {
+        // The synchronous client abandoned or closed the connection
         return ESP_FAIL;
     }
 
@@ -77,16 +286,81 @@ esp_err_t Server::handleRequest(PsychicRequest * request) {
         return ret;
     }
 
+    if (ptr->tracing()) {
+        ptr->trace(FrameTracer::FRAME, ws_pkt.type, ws_pkt.len, ptr->available());
+    }
+
+    // any traffic proves that the peer is alive
+    pwscp->missed_pongs = 0;
+
+    if ((ws_pkt.type == HTTPD_WS_TYPE_PING) || (ws_pkt.type == HTTPD_WS_TYPE_PONG)
+            || (ws_pkt.type == HTTPD_WS_TYPE_CLOSE)) {
+        // control frames aren't application data, they bypass the rate limit and never reach the proxy
+        return handle_control_frame(pwscp, wsRequest.request(), &ws_pkt);
+    }
+
+    if (pwscp->byte_bucket.enabled() || pwscp->frame_bucket.enabled()) {
+        pwscp->byte_bucket.update(micros());
+        pwscp->frame_bucket.update(micros());
+
+        const bool oversized = !pwscp->byte_bucket.fits(ws_pkt.len);
+        if (oversized || pwscp->byte_bucket.empty() || pwscp->frame_bucket.empty()) {
+            ++pwscp->throttled_frames;
+            ++throttled_frames;
+
+            RateLimitAction action = rate_limit_action;
+            if (oversized && (action == RATE_LIMIT_DELAY)) {
+                // the frame would never fit, don't stall the server's task waiting for it
+                action = RATE_LIMIT_DROP;
+            }
+
+            switch (action) {
+                case RATE_LIMIT_DELAY: {
+                    const unsigned long byte_wait = pwscp->byte_bucket.wait_time_ms();
+                    const unsigned long frame_wait = pwscp->frame_bucket.wait_time_ms();
+                    delay(byte_wait > frame_wait ? byte_wait : frame_wait);
+                    pwscp->byte_bucket.update(micros());
+                    pwscp->frame_bucket.update(micros());
+                    break;
+                }
+                case RATE_LIMIT_DROP:
+                    ret = drop_frame(wsRequest.request(), &ws_pkt);
+                    if (ret == ESP_ERR_INVALID_SIZE) {
+                        // too large to be dropped, 1009 is message too big
+                        ptr->close(1009);
+                    }
+                    return ret;
+                case RATE_LIMIT_CLOSE:
+                    // 1008 is policy violation
+                    ptr->close(1008);
+                    return ESP_FAIL;
+            }
+        }
+
+        pwscp->byte_bucket.consume(ws_pkt.len);
+        pwscp->frame_bucket.consume(1);
+    }
+
     if (!ws_pkt.len) {
         return ESP_OK;
     }
 
     // push to proxy
+    const unsigned long recv_start = ptr->tracing() ? micros() : 0;
     ret = ptr->recv(wsRequest.request(), &ws_pkt);
 
+    if (ptr->tracing()) {
+        ptr->trace(FrameTracer::RECV, ws_pkt.type, micros() - recv_start, ret);
+    }
+
     // logging housekeeping
     if (ret != ESP_OK) {
+        ++recv_errors;
         ESP_LOGE(PH_TAG, "Proxy::recv() failed with %s", esp_err_to_name(ret));
+    } else {
+        ++frames_received;
+        bytes_received += ws_pkt.len;
+        ptr->notify_receive();
     }
 
     return ret;
@@ -1,15 +1,18 @@
 #pragma once
 
+#include <atomic>
+#include <condition_variable>
 #include <functional>
-#include <list>
-#include <memory>
 #include <mutex>
 
+#include <esp_timer.h>
 #include <PsychicHttp.h>
 
 #include "proxy.h"
 #include "single_frame_proxy.h"
 #include "client.h"
+#include "rate_limit.h"
+#include "tracer.h"
 
 namespace PsychicWebSocketProxy {
 
@@ -18,24 +21,135 @@ class Server: public PsychicWebSocketHandler {
         // This class's name is terrible
         class PsychicWebSocketClientProxy: public PsychicWebSocketClient {
             public:
-                PsychicWebSocketClientProxy(PsychicClient * client, const std::shared_ptr<Proxy> & proxy);
+                PsychicWebSocketClientProxy(PsychicClient * client, Proxy * proxy);
                 virtual ~PsychicWebSocketClientProxy();
-                const std::weak_ptr<Proxy> proxy;
+                Proxy * const proxy;
+
+                // keepalive state, only accessed from the server's task
+                unsigned int missed_pongs;
+
+                // rate limiting state, only accessed from the server's task
+                TokenBucket byte_bucket;
+                TokenBucket frame_bucket;
+                unsigned long throttled_frames;
+        };
+
+        enum RateLimitAction {
+            RATE_LIMIT_DELAY,   // block the server's task until the frame is within the limit
+            RATE_LIMIT_DROP,    // receive the frame, but throw it away
+            RATE_LIMIT_CLOSE,   // close the connection
         };
 
         Server(std::function<Proxy *()> proxy_factory = [] { return new SingleFrameProxy(); });
+        virtual ~Server();
         Client accept();
         void begin() { /* noop */ }
 
         esp_err_t handleRequest(PsychicRequest * request) override;
 
+        /* Record traffic of all clients connecting from now on, pass nullptr to stop tracing new clients.  Clients,
+         * which are already connected, keep using the previous tracer, so it must not be destroyed before they
+         * disconnect.  See FrameTracer for details.
+         */
+        void set_tracer(FrameTracer * tracer) { this->tracer = tracer; }
+
+        /* Ping all clients every interval_ms milliseconds (0 disables pings).  Connections, from which nothing was
+         * received during max_missed_pongs ping intervals in a row or on which the ping can't be sent, are closed and
+         * their proxy buffers are released immediately.  Any frame counts as a response, not just a PONG.  With
+         * max_missed_pongs set to 0, pings are sent, but connections are never closed for not responding.
+         *
+         * NOTE: ESP-IDF answers PINGs and consumes PONGs itself, unless the endpoint is registered with
+         * handle_ws_control_frames set (see README).  Without that, peers must send data of their own (e.g. MQTT
+         * keepalive packets) more often than every max_missed_pongs intervals to stay connected.
+         *
+         * The checks run on the server's task.  If one is queued when the Server is destroyed, the destructor waits
+         * for it, so the HTTP server must still be running at that point.
+         */
+        void set_keepalive(unsigned long interval_ms, unsigned int max_missed_pongs = 2);
+
+        // number of connections closed because the peer stopped responding
+        unsigned long get_keepalive_closes() const { return keepalive_closes; }
+
+        /* Limit the incoming traffic of each connection to the given number of bytes and frames per second (0 means
+         * unlimited).  Short bursts of up to one second worth of traffic are allowed.  The limit is checked before a
+         * frame is read and action specifies what happens to frames exceeding it.  The limits apply to clients
+         * connecting after the call, the action applies to all clients right away.  This can be called at any time,
+         * from any task.
+         *
+         * Frames larger than bytes_per_second always exceed the limit.  Waiting wouldn't help them, so they're
+         * dropped even with RATE_LIMIT_DELAY, which in turn never delays a frame by more than about a second.
+         * Dropped frames must still be read, which is only possible for frames of up to 1 kB.  Connections sending
+         * larger frames, which need to be dropped, are closed instead.
+         */
+        void set_rate_limit(uint32_t bytes_per_second, uint32_t frames_per_second,
+                            RateLimitAction action = RATE_LIMIT_DELAY);
+
+        // number of frames, which exceeded the rate limit
+        unsigned long get_throttled_frames() const { return throttled_frames; }
+
+        /* Counters describing the server's activity since it was created.  They're cheap to maintain and safe to
+         * read from any task, so they can be logged periodically to spot connection leaks or to measure throughput
+         * by comparing two snapshots.
+         */
+        struct Stats {
+            unsigned long connections_opened;       // sessions set up by addClient()
+            unsigned long connections_accepted;     // sessions returned by accept()
+            unsigned long connections_closed;       // sessions torn down by removeClient()
+            unsigned long frames_received;          // data frames stored in proxies
+            unsigned long bytes_received;           // payload bytes stored in proxies
+            unsigned long recv_errors;              // frames, which Proxy::recv() failed to store
+            unsigned long max_accept_latency_us;    // longest time a session waited in the accept queue (microseconds)
+        };
+
+        Stats get_stats() const;
+
     protected:
         virtual void addClient(PsychicClient * client) override;
         virtual void removeClient(PsychicClient * client) override;
 
+        static void keepalive_timer_callback(void * arg);
+        static void keepalive_work(void * arg);
+        void check_keepalive();
+
+        esp_err_t drop_frame(httpd_req_t * request, httpd_ws_frame_t * frame);
+        esp_err_t handle_control_frame(PsychicWebSocketClientProxy * pwscp, httpd_req_t * request,
+                                       httpd_ws_frame_t * frame);
+
+        // payloads of dropped frames are read into this buffer, it's only used on the server's task
+        uint8_t drop_buffer[1024];
+
         std::mutex accept_mutex;
-        std::list<Client> waiting_clients;
+        // intrusive queue of connections waiting for accept(), linked using Proxy::next_waiting
+        Proxy * waiting_head;
+        Proxy * waiting_tail;
         const std::function<Proxy *()> proxy_factory;
+        std::atomic<FrameTracer *> tracer;
+
+        // httpd is set on the server's task and read on the esp_timer task
+        std::atomic<httpd_handle_t> httpd;
+        esp_timer_handle_t keepalive_timer;
+        std::atomic<unsigned int> keepalive_max_missed_pongs;
+        std::atomic<unsigned long> keepalive_closes;
+        // keepalive_pending is set while keepalive_work() is queued on the server's task, the destructor waits for it
+        std::mutex keepalive_mutex;
+        std::condition_variable keepalive_cond;
+        bool keepalive_pending;
+        bool keepalive_stopping;
+
+        // set by set_rate_limit() on the caller's task, read on the server's task
+        std::atomic<uint32_t> rate_limit_bytes_per_second;
+        std::atomic<uint32_t> rate_limit_frames_per_second;
+        std::atomic<RateLimitAction> rate_limit_action;
+        std::atomic<unsigned long> throttled_frames;
+
+        std::atomic<unsigned long> connections_opened;
+        std::atomic<unsigned long> connections_accepted;
+        std::atomic<unsigned long> connections_closed;
+        std::atomic<unsigned long> frames_received;
+        std::atomic<unsigned long> bytes_received;
+        std::atomic<unsigned long> recv_errors;
+        // only updated with accept_mutex locked
+        std::atomic<unsigned long> max_accept_latency_us;
 };
 
 }
@@ -18,21 +18,33 @@ namespace PsychicWebSocketProxy {
  */
 class ShiftingBufferProxy: public StaticBufferProxy {
     public:
+        using StaticBufferProxy::StaticBufferProxy;
+
         virtual esp_err_t recv(httpd_req_t * request, httpd_ws_frame_t * frame) override {
             const size_t frame_size = frame->len;
 
             std::unique_lock<std::mutex> lock(recv_mutex);
+
+            if (frame_size > size) {
+                return receive_spill(request, frame, lock);
+            }
+
             if (!cond.wait_for(
                         lock,
                         timeout,
             [this, frame_size]() -> bool {
             const size_t space_total = size - (write_ptr - read_ptr);
-                return frame_size <= space_total;
+                return (!spill && frame_size <= space_total) || !connected();
             })) {
                 // no space left in buffer
                 return error_on_no_memory;
             }
 
+            if (!connected()) {
+                // connection closed while waiting, the buffer is already gone
+                return ESP_FAIL;
+            }
+
             const size_t space_tail = (buffer + size) - write_ptr;
 
             if (space_tail < frame_size) {
@@ -2,8 +2,6 @@
 
 #include <Arduino.h>
 
-#include <condition_variable>
-
 #include "proxy.h"
 
 namespace PsychicWebSocketProxy {
@@ -60,12 +58,17 @@ class SingleFrameProxy: public Proxy {
                         lock,
                         timeout,
             [this]() -> bool {
-            return !read_ptr;
+            return !read_ptr || !connected();
         })) {
                 // no space left in buffer
                 return error_on_no_memory;
             }
 
+            if (!connected()) {
+                // connection closed while waiting, buffers are already gone
+                return ESP_FAIL;
+            }
+
             if (buffer_size < frame->len) {
                 // buffer too small for frame
                 char * new_buffer = (char *) realloc(buffer, frame->len);
@@ -85,18 +88,18 @@ class SingleFrameProxy: public Proxy {
             } else {
                 read_ptr = buffer;
                 frame_size = frame->len;
+                data_changed();
             }
 
             return ret;
         }
 
-        virtual int available() override {
-            const std::lock_guard<std::mutex> lock(recv_mutex);
-            return read_ptr ? (buffer + frame_size - read_ptr) : 0;
-        }
-
         virtual int read(uint8_t * ptr, size_t len) {
             const std::lock_guard<std::mutex> lock(recv_mutex);
+            if (!read_ptr) {
+                // no frame buffered
+                return 0;
+            }
             const size_t bytes_available = buffer + frame_size - read_ptr;
             const size_t bytes_to_read = len < bytes_available ? len : bytes_available;
             memcpy(ptr, read_ptr, bytes_to_read);
@@ -105,8 +108,8 @@ class SingleFrameProxy: public Proxy {
                 // all queued data consumed
                 read_ptr = nullptr;
                 frame_size = 0;
-                cond.notify_all();
             }
+            data_changed();
             return bytes_to_read;
         }
 
@@ -119,8 +122,16 @@ class SingleFrameProxy: public Proxy {
         const esp_err_t error_on_no_memory;
 
     protected:
-        std::mutex recv_mutex;
-        std::condition_variable cond;
+        virtual void discard() override {
+            const std::lock_guard<std::mutex> lock(recv_mutex);
+            free(buffer);
+            buffer = nullptr;
+            buffer_size = 0;
+            read_ptr = nullptr;
+            frame_size = 0;
+        }
+
+        virtual size_t buffered() override { return read_ptr ? (buffer + frame_size - read_ptr) : 0; }
 
         char * buffer;
         size_t buffer_size;
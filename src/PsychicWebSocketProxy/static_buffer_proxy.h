@@ -2,8 +2,6 @@
 
 #include <Arduino.h>
 
-#include <condition_variable>
-
 #include "proxy.h"
 
 namespace PsychicWebSocketProxy {
@@ -43,15 +41,29 @@ namespace PsychicWebSocketProxy {
  *
  * On top of that, the implementation is simple and easy to understand, and therefore
  * less likely to contain bugs.
+ *
+ * Frames larger than the buffer can never fit into it.  By default such frames are
+ * rejected with error_on_no_memory.  If spill_limit is set, frames up to spill_limit
+ * bytes are instead received into a temporary spill buffer allocated with the given
+ * heap capabilities (e.g. MALLOC_CAP_SPIRAM to use PSRAM).  The spill buffer is read
+ * after the data already in the buffer and freed as soon as it's consumed.  Only one
+ * spill buffer is used at a time and no new data is stored in the main buffer until
+ * it's consumed, which preserves the order of the data.
  */
 class StaticBufferProxy: public Proxy {
     public:
         StaticBufferProxy(const size_t size = 1024, unsigned long timeout_ms = 3000,
-                          esp_err_t error_on_no_memory = ESP_ERR_NO_MEM):
+                          esp_err_t error_on_no_memory = ESP_ERR_NO_MEM, size_t spill_limit = 0,
+                          uint32_t spill_caps = MALLOC_CAP_8BIT):
             size(size), timeout(timeout_ms), error_on_no_memory(error_on_no_memory),
-            buffer((char *) malloc(size)), read_ptr(buffer), write_ptr(buffer) {}
+            spill_limit(spill_limit), spill_caps(spill_caps),
+            buffer((char *) malloc(size)), read_ptr(buffer), write_ptr(buffer),
+            spill(nullptr), spill_size(0), spill_offset(0) {}
 
-        virtual ~StaticBufferProxy() { free(buffer); }
+        virtual ~StaticBufferProxy() {
+            free(buffer);
+            free(spill);
+        }
 
         virtual size_t get_space_available_for_write() {
             const size_t space_tail = (buffer + size) - write_ptr;
@@ -62,23 +74,28 @@ class StaticBufferProxy: public Proxy {
             const size_t frame_size = frame->len;
 
             std::unique_lock<std::mutex> lock(recv_mutex);
+
+            if (frame_size > size) {
+                return receive_spill(request, frame, lock);
+            }
+
             if (!cond.wait_for(
                         lock,
                         timeout,
             [this, frame_size]() -> bool {
             const size_t space_tail = (buffer + size) - write_ptr;
-                return frame_size <= space_tail;
+                return (!spill && frame_size <= space_tail) || !connected();
             })) {
                 // no space left in buffer
                 return error_on_no_memory;
             }
 
-            return receive_data(request, frame);
-        }
+            if (!connected()) {
+                // connection closed while waiting, the buffer is already gone
+                return ESP_FAIL;
+            }
 
-        virtual int available() override {
-            const std::lock_guard<std::mutex> lock(recv_mutex);
-            return write_ptr - read_ptr;
+            return receive_data(request, frame);
         }
 
         virtual int read(uint8_t * ptr, size_t len) {
@@ -95,21 +112,107 @@ class StaticBufferProxy: public Proxy {
                     read_ptr = buffer;
                     write_ptr = buffer;
                 }
-                cond.notify_all();
+                data_changed();
             }
-            return bytes_to_read;
+            return bytes_to_read + read_spill(ptr + bytes_to_read, len - bytes_to_read);
         }
 
         virtual int peek() override {
             const std::lock_guard<std::mutex> lock(recv_mutex);
-            return (write_ptr != read_ptr) ? ((unsigned char *) read_ptr)[0] : -1;
+            if (write_ptr != read_ptr) {
+                return ((unsigned char *) read_ptr)[0];
+            } else if (spill) {
+                return ((unsigned char *) spill)[spill_offset];
+            } else {
+                return -1;
+            }
         }
 
         const size_t size;
         const std::chrono::milliseconds timeout;
         const esp_err_t error_on_no_memory;
+        const size_t spill_limit;
+        const uint32_t spill_caps;
 
     protected:
+        virtual void discard() override {
+            const std::lock_guard<std::mutex> lock(recv_mutex);
+            free(buffer);
+            buffer = nullptr;
+            read_ptr = nullptr;
+            write_ptr = nullptr;
+            free(spill);
+            spill = nullptr;
+            spill_size = 0;
+            spill_offset = 0;
+        }
+
+        virtual size_t buffered() override { return (write_ptr - read_ptr) + (spill_size - spill_offset); }
+
+        /* Receive a frame, which is too big for the buffer, into the spill buffer.  This waits until the previous
+           spill buffer is consumed. */
+        esp_err_t receive_spill(httpd_req_t * request, httpd_ws_frame_t * frame, std::unique_lock<std::mutex> & lock) {
+            const size_t frame_size = frame->len;
+
+            if (frame_size > spill_limit) {
+                // the frame will never fit
+                return error_on_no_memory;
+            }
+
+            if (!cond.wait_for(
+                        lock,
+                        timeout,
+            [this]() -> bool {
+            return !spill || !connected();
+            })) {
+                // previous spill buffer still not consumed
+                return error_on_no_memory;
+            }
+
+            if (!connected()) {
+                // connection closed while waiting
+                return ESP_FAIL;
+            }
+
+            char * new_spill = (char *) heap_caps_malloc(frame_size, spill_caps);
+            if (!new_spill) {
+                return error_on_no_memory;
+            }
+
+            frame->payload = (uint8_t *)(new_spill);
+            esp_err_t ret = httpd_ws_recv_frame(request, frame, frame_size);
+            if (ret != ESP_OK) {
+                ESP_LOGE(PH_TAG, "httpd_ws_recv_frame failed with %s", esp_err_to_name(ret));
+                free(new_spill);
+            } else {
+                spill = new_spill;
+                spill_size = frame_size;
+                spill_offset = 0;
+                data_changed();
+            }
+            return ret;
+        }
+
+        /* Read data from the spill buffer, this must only be called when the main buffer is empty.  The spill
+           buffer is freed once it's fully consumed. */
+        size_t read_spill(uint8_t * ptr, size_t len) {
+            if (!spill || !len) {
+                return 0;
+            }
+            const size_t bytes_available = spill_size - spill_offset;
+            const size_t bytes_to_read = len < bytes_available ? len : bytes_available;
+            memcpy(ptr, spill + spill_offset, bytes_to_read);
+            spill_offset += bytes_to_read;
+            if (spill_offset >= spill_size) {
+                free(spill);
+                spill = nullptr;
+                spill_size = 0;
+                spill_offset = 0;
+            }
+            data_changed();
+            return bytes_to_read;
+        }
+
         /* Read received data into the buffer (at write_ptr) */
         esp_err_t receive_data(httpd_req_t * request, httpd_ws_frame_t * frame) {
             const size_t frame_size = frame->len;
@@ -119,16 +222,18 @@ class StaticBufferProxy: public Proxy {
                 ESP_LOGE(PH_TAG, "httpd_ws_recv_frame failed with %s", esp_err_to_name(ret));
             } else {
                 write_ptr += frame_size;
+                data_changed();
             }
             return ret;
         }
 
-        std::mutex recv_mutex;
-        std::condition_variable cond;
-
         char * buffer;
         char * read_ptr;
         char * write_ptr;
+
+        char * spill;
+        size_t spill_size;
+        size_t spill_offset;
 };
 
 }
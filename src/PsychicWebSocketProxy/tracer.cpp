@@ -0,0 +1,79 @@
+#include "tracer.h"
+
+namespace PsychicWebSocketProxy {
+
+FrameTracer::FrameTracer(Print & sink, size_t buffer_records):
+    sink(sink), buffer_records(buffer_records ? buffer_records : 1), buffers(new Record[2 * this->buffer_records]),
+    active(buffers), active_records(0), pending(nullptr), pending_records(0), dropped_records(0),
+    last_connection_id(0) {}
+
+FrameTracer::~FrameTracer() {
+    flush();
+    delete[] buffers;
+}
+
+uint16_t FrameTracer::next_connection_id() {
+    const std::lock_guard<std::mutex> lock(mutex);
+    return ++last_connection_id;
+}
+
+void FrameTracer::record(Event event, uint16_t connection, uint8_t type, uint32_t a, uint32_t b) {
+    const uint32_t timestamp = micros();
+    const std::lock_guard<std::mutex> lock(mutex);
+    if (active_records >= buffer_records) {
+        if (pending) {
+            // both buffers are full, flush() isn't called often enough
+            ++dropped_records;
+            return;
+        }
+        pending = active;
+        pending_records = active_records;
+        active = other_buffer(active);
+        active_records = 0;
+    }
+    Record & record = active[active_records++];
+    record.event = event;
+    record.type = type;
+    record.connection = connection;
+    record.timestamp = timestamp;
+    record.a = a;
+    record.b = b;
+}
+
+void FrameTracer::flush() {
+    const std::lock_guard<std::mutex> flush_lock(flush_mutex);
+    // first the full buffer (if there is one), then whatever is in the active buffer
+    for (int i = 0; i < 2; ++i) {
+        Record * data;
+        size_t records;
+        {
+            const std::lock_guard<std::mutex> lock(mutex);
+            if (!pending) {
+                if (!active_records) {
+                    break;
+                }
+                pending = active;
+                pending_records = active_records;
+                active = other_buffer(active);
+                active_records = 0;
+            }
+            data = pending;
+            records = pending_records;
+        }
+
+        // the sink may be slow, so write without holding the lock
+        sink.write((const uint8_t *) data, records * sizeof(Record));
+
+        const std::lock_guard<std::mutex> lock(mutex);
+        pending = nullptr;
+        pending_records = 0;
+    }
+    sink.flush();
+}
+
+unsigned long FrameTracer::get_dropped_records() {
+    const std::lock_guard<std::mutex> lock(mutex);
+    return dropped_records;
+}
+
+}
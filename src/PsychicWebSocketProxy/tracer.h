@@ -0,0 +1,87 @@
+#pragma once
+
+#include <mutex>
+
+#include <Arduino.h>
+
+namespace PsychicWebSocketProxy {
+
+/* This class records a compact binary trace of the websocket traffic handled by a Server.  The trace can be used to
+ * reproduce the exact frame sizes and timing seen in the field and to test different Proxy implementations against
+ * them offline.
+ *
+ * To enable tracing, pass a FrameTracer to Server::set_tracer() before any clients connect.  Records are collected
+ * in two in-memory buffers.  They are only written to the sink (e.g. a LittleFS File or Serial) by flush(), which
+ * should be called regularly from the main loop.  This way a slow sink never blocks the server's task.  When both
+ * buffers are full, new records are dropped and counted, see get_dropped_records().
+ *
+ * The tracer must outlive all connections traced with it.  Each connection keeps a pointer to the tracer set when
+ * it was opened, Server::set_tracer(nullptr) only stops tracing new connections.
+ *
+ * The trace is a sequence of Record structures (16 bytes each, little-endian):
+ *
+ *   event       type       a                   b
+ *   OPEN        0          0                   0                   new connection
+ *   FRAME       frame type frame length        bytes buffered      frame arrived in Server::handleRequest
+ *   RECV        frame type Proxy::recv() time  Proxy::recv() ret   frame pushed to proxy (time in microseconds)
+ *   READ        0          bytes requested     bytes returned      Client::read() call
+ *   CLOSE       0          0                   0                   connection closed
+ *
+ * Timestamps are micros() values, so they wrap around after about 71 minutes.
+ */
+class FrameTracer {
+    public:
+        enum Event : uint8_t {
+            OPEN = 1,
+            FRAME = 2,
+            RECV = 3,
+            READ = 4,
+            CLOSE = 5,
+        };
+
+        struct Record {
+            uint8_t event;
+            uint8_t type;
+            uint16_t connection;
+            uint32_t timestamp;
+            uint32_t a;
+            uint32_t b;
+        } __attribute__((packed));
+
+        // buffer_records is the size of each of the two buffers
+        FrameTracer(Print & sink, size_t buffer_records = 64);
+        ~FrameTracer();
+
+        FrameTracer(const FrameTracer & other) = delete;
+        const FrameTracer & operator=(const FrameTracer & other) = delete;
+
+        uint16_t next_connection_id();
+        void record(Event event, uint16_t connection, uint8_t type = 0, uint32_t a = 0, uint32_t b = 0);
+
+        // Write all buffered records to the sink.  Recording continues into the other buffer while this runs.
+        void flush();
+
+        // number of records lost, because both buffers were full
+        unsigned long get_dropped_records();
+
+    protected:
+        Record * other_buffer(Record * buffer) const { return buffer == buffers ? buffers + buffer_records : buffers; }
+
+        // mutex protects the buffers, flush_mutex serializes flush() calls
+        std::mutex mutex;
+        std::mutex flush_mutex;
+        Print & sink;
+        const size_t buffer_records;
+        Record * const buffers;
+
+        // records are added to the active buffer, the pending one is full and waits to be written by flush()
+        Record * active;
+        size_t active_records;
+        Record * pending;
+        size_t pending_records;
+
+        unsigned long dropped_records;
+        uint16_t last_connection_id;
+};
+
+}
@@ -0,0 +1,12 @@
+#pragma once
+
+#include <cstdio>
+#include <cstdlib>
+
+// Like assert(), but also active in release builds
+#define CHECK(condition) do { \
+        if (!(condition)) { \
+            fprintf(stderr, "%s:%d: check failed: %s\n", __FILE__, __LINE__, #condition); \
+            abort(); \
+        } \
+    } while (0)
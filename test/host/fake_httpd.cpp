@@ -0,0 +1,293 @@
+#include <future>
+
+#include <malloc.h>
+
+#include "fake_httpd.h"
+
+namespace fake {
+
+Httpd::Httpd(PsychicHandler & handler, size_t max_queue): handler(handler), max_queue(max_queue), stopping(false),
+    last_socket(0), send_delay_us(0), handled(0), failed(0), overlapping_sends(0) {
+    thread = std::thread([this] { run(); });
+}
+
+Httpd::~Httpd() {
+    // close all remaining sessions, like httpd_stop() does
+    std::promise<void> done;
+    queue_work([this, &done] {
+        std::vector<int> sockets;
+        {
+            const std::lock_guard<std::mutex> lock(sessions_mutex);
+            for (const auto & it : sessions) {
+                if (it.second.client) {
+                    sockets.push_back(it.first);
+                }
+            }
+        }
+        for (int socket : sockets) {
+            close_session(socket);
+        }
+        done.set_value();
+    });
+    done.get_future().wait();
+
+    {
+        const std::lock_guard<std::mutex> lock(queue_mutex);
+        stopping = true;
+    }
+    queue_cond.notify_all();
+    thread.join();
+}
+
+void Httpd::run() {
+    while (true) {
+        std::function<void()> work;
+        {
+            std::unique_lock<std::mutex> lock(queue_mutex);
+            queue_cond.wait(lock, [this] { return stopping || !queue.empty(); });
+            if (queue.empty()) {
+                return;
+            }
+            work = std::move(queue.front());
+            queue.pop_front();
+        }
+        queue_cond.notify_all();
+        work();
+    }
+}
+
+esp_err_t Httpd::queue_work(std::function<void()> work, bool wait_for_space) {
+    {
+        std::unique_lock<std::mutex> lock(queue_mutex);
+        if (wait_for_space && !on_httpd_task()) {
+            queue_cond.wait(lock, [this] { return stopping || (queue.size() < max_queue); });
+        }
+        if (stopping) {
+            return ESP_FAIL;
+        }
+        queue.push_back(std::move(work));
+    }
+    queue_cond.notify_all();
+    return ESP_OK;
+}
+
+PsychicClient * Httpd::find_client(int socket) {
+    const std::lock_guard<std::mutex> lock(sessions_mutex);
+    auto it = sessions.find(socket);
+    return (it == sessions.end()) ? nullptr : it->second.client;
+}
+
+int Httpd::open() {
+    std::promise<int> result;
+    queue_work([this, &result] {
+        PsychicClient * client;
+        {
+            const std::lock_guard<std::mutex> lock(sessions_mutex);
+            const int socket = ++last_socket;
+            client = new PsychicClient(this, socket);
+            sessions[socket] = Session{client, {}, 0};
+        }
+        // the websocket handshake is a GET request
+        httpd_req_t req = { this, nullptr };
+        PsychicRequest request(client, HTTP_GET, &req);
+        handler.handleRequest(&request);
+        result.set_value(client->socket());
+    });
+    return result.get_future().get();
+}
+
+void Httpd::close(int socket) {
+    std::promise<void> done;
+    queue_work([this, socket, &done] {
+        close_session(socket);
+        done.set_value();
+    });
+    done.get_future().wait();
+}
+
+esp_err_t Httpd::trigger_close(int socket) {
+    if (!find_client(socket)) {
+        return ESP_ERR_INVALID_ARG;
+    }
+    return queue_work([this, socket] { close_session(socket); });
+}
+
+void Httpd::close_session(int socket) {
+    PsychicClient * client = find_client(socket);
+    if (!client) {
+        return;
+    }
+    handler.checkForClosedClient(client);
+    {
+        // keep the session entry, so that the frames sent before closing can still be inspected
+        const std::lock_guard<std::mutex> lock(sessions_mutex);
+        sessions[socket].client = nullptr;
+    }
+    delete client;
+}
+
+esp_err_t Httpd::handle_frame(int socket, Frame & frame) {
+    PsychicClient * client = find_client(socket);
+    if (!client) {
+        return ESP_FAIL;
+    }
+    httpd_req_t req = { this, &frame };
+    PsychicRequest request(client, HTTP_POST, &req);
+    const esp_err_t ret = handler.handleRequest(&request);
+    ++handled;
+    if (ret != ESP_OK) {
+        // ESP-IDF closes the session when the handler fails
+        ++failed;
+        close_session(socket);
+    }
+    return ret;
+}
+
+esp_err_t Httpd::send(int socket, const std::string & payload, httpd_ws_type_t type) {
+    std::promise<esp_err_t> result;
+    queue_work([this, socket, &payload, type, &result] {
+        Frame frame = { type, payload, false };
+        result.set_value(handle_frame(socket, frame));
+    });
+    return result.get_future().get();
+}
+
+void Httpd::post(int socket, const std::string & payload, httpd_ws_type_t type) {
+    queue_work([this, socket, payload, type] {
+        Frame frame = { type, payload, false };
+        handle_frame(socket, frame);
+    }, true);
+}
+
+void Httpd::sync() {
+    std::promise<void> done;
+    queue_work([&done] { done.set_value(); });
+    done.get_future().wait();
+}
+
+bool Httpd::is_open(int socket) {
+    return find_client(socket);
+}
+
+size_t Httpd::session_count() {
+    const std::lock_guard<std::mutex> lock(sessions_mutex);
+    size_t count = 0;
+    for (const auto & it : sessions) {
+        count += it.second.client ? 1 : 0;
+    }
+    return count;
+}
+
+std::vector<SentFrame> Httpd::sent(int socket) {
+    const std::lock_guard<std::mutex> lock(sessions_mutex);
+    auto it = sessions.find(socket);
+    return (it == sessions.end()) ? std::vector<SentFrame>() : it->second.sent;
+}
+
+esp_err_t Httpd::send_message(int socket, httpd_ws_type_t type, const void * data, size_t len) {
+    if (len && !data) {
+        return ESP_ERR_INVALID_ARG;
+    }
+
+    {
+        const std::lock_guard<std::mutex> lock(sessions_mutex);
+        auto it = sessions.find(socket);
+        if ((it == sessions.end()) || !it->second.client) {
+            return ESP_FAIL;
+        }
+        if (it->second.sending++) {
+            ++overlapping_sends;
+        }
+    }
+
+    if (send_delay_us) {
+        std::this_thread::sleep_for(std::chrono::microseconds(send_delay_us));
+    }
+
+    const std::lock_guard<std::mutex> lock(sessions_mutex);
+    auto it = sessions.find(socket);
+    --it->second.sending;
+    it->second.sent.push_back(SentFrame{type, std::string((const char *) data, len)});
+    return ESP_OK;
+}
+
+size_t heap_in_use() {
+    return mallinfo2().uordblks;
+}
+
+}
+
+// ESP-IDF httpd API
+
+esp_err_t httpd_ws_recv_frame(httpd_req_t * req, httpd_ws_frame_t * frame, size_t max_len) {
+    fake::Frame * fake_frame = (fake::Frame *) req->aux;
+    if (!fake_frame) {
+        return ESP_ERR_INVALID_STATE;
+    }
+
+    frame->final = true;
+    frame->fragmented = false;
+    frame->type = fake_frame->type;
+    frame->len = fake_frame->payload.size();
+
+    if (!max_len) {
+        // header only
+        return ESP_OK;
+    }
+
+    if (fake_frame->payload_read) {
+        // the payload is gone already
+        return ESP_FAIL;
+    }
+
+    if (max_len < frame->len) {
+        // no partial reads
+        return ESP_ERR_INVALID_SIZE;
+    }
+
+    if (!frame->payload) {
+        return ESP_ERR_INVALID_ARG;
+    }
+
+    memcpy(frame->payload, fake_frame->payload.data(), frame->len);
+    fake_frame->payload_read = true;
+    return ESP_OK;
+}
+
+esp_err_t httpd_sess_trigger_close(httpd_handle_t handle, int sockfd) {
+    return ((fake::Httpd *) handle)->trigger_close(sockfd);
+}
+
+esp_err_t httpd_queue_work(httpd_handle_t handle, httpd_work_fn_t work, void * arg) {
+    return ((fake::Httpd *) handle)->queue_work([work, arg] { work(arg); });
+}
+
+// PsychicHttp
+
+esp_err_t PsychicWebSocketClient::sendMessage(httpd_ws_type_t op, const void * data, size_t len) {
+    return ((fake::Httpd *) _server)->send_message(_socket, op, data, len);
+}
+
+bool PsychicHandler::hasClient(PsychicClient * client) {
+    for (PsychicClient * c : _clients) {
+        if (c == client) {
+            return true;
+        }
+    }
+    return false;
+}
+
+PsychicClient * PsychicHandler::checkForNewClient(PsychicClient * client) {
+    client->isNew = !hasClient(client);
+    if (client->isNew) {
+        addClient(client);
+    }
+    return client;
+}
+
+void PsychicHandler::checkForClosedClient(PsychicClient * client) {
+    if (hasClient(client)) {
+        closeCallback(client);
+        removeClient(client);
+    }
+}
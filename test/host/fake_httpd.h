@@ -0,0 +1,116 @@
+#pragma once
+
+#include <atomic>
+#include <condition_variable>
+#include <deque>
+#include <functional>
+#include <map>
+#include <mutex>
+#include <string>
+#include <thread>
+#include <vector>
+
+#include <PsychicHttp.h>
+
+namespace fake {
+
+// A frame received from the peer, read by httpd_ws_recv_frame()
+struct Frame {
+    httpd_ws_type_t type;
+    std::string payload;
+    bool payload_read;
+};
+
+// A frame sent to the peer using PsychicWebSocketClient::sendMessage()
+struct SentFrame {
+    httpd_ws_type_t type;
+    std::string payload;
+};
+
+/* Fake ESP-IDF httpd serving a single websocket endpoint.  Like the real one, it runs all handler calls on a single
+ * thread (the "httpd task"), so a handler blocking in Proxy::recv() stalls every session.  Frames can be delivered
+ * from any number of threads.  Sessions are closed when the peer disconnects (close()), when the handler fails or
+ * when the session close is triggered with httpd_sess_trigger_close().
+ */
+class Httpd {
+    public:
+        // max_queue limits the number of pending work items, post() blocks when the limit is reached
+        Httpd(PsychicHandler & handler, size_t max_queue = 256);
+        ~Httpd();
+
+        Httpd(const Httpd & other) = delete;
+        const Httpd & operator=(const Httpd & other) = delete;
+
+        // Open a new websocket session and wait until the handler processed the handshake, returns the socket number
+        int open();
+
+        // Close the session from the peer's side and wait until the handler removed the client
+        void close(int socket);
+
+        // Deliver a frame and wait until it's handled, returns the handler's result
+        esp_err_t send(int socket, const std::string & payload, httpd_ws_type_t type = HTTPD_WS_TYPE_BINARY);
+
+        // Deliver a frame without waiting for the handler
+        void post(int socket, const std::string & payload, httpd_ws_type_t type = HTTPD_WS_TYPE_BINARY);
+
+        // Wait until all work queued so far is processed
+        void sync();
+
+        bool is_open(int socket);
+        size_t session_count();
+
+        // frames sent to the peer so far, this works for closed sessions too
+        std::vector<SentFrame> sent(int socket);
+
+        // Make each sendMessage() call take this long, which makes overlapping sends easier to detect
+        void set_send_delay_us(unsigned long delay_us) { send_delay_us = delay_us; }
+
+        // number of frames handled and number of frames, for which the handler failed
+        unsigned long frames_handled() const { return handled; }
+        unsigned long frames_failed() const { return failed; }
+
+        // number of sendMessage() calls, which started while another send on the same session was in progress
+        unsigned long concurrent_sends() const { return overlapping_sends; }
+
+        // used by the httpd and PsychicHttp stand-ins
+        esp_err_t queue_work(std::function<void()> work, bool wait_for_space = false);
+        esp_err_t trigger_close(int socket);
+        esp_err_t send_message(int socket, httpd_ws_type_t type, const void * data, size_t len);
+        bool on_httpd_task() const { return std::this_thread::get_id() == thread.get_id(); }
+
+    protected:
+        struct Session {
+            PsychicClient * client;     // NULL after the session is closed
+            std::vector<SentFrame> sent;
+            unsigned int sending;
+        };
+
+        void run();
+        esp_err_t handle_frame(int socket, Frame & frame);
+        void close_session(int socket);
+        PsychicClient * find_client(int socket);
+
+        PsychicHandler & handler;
+        const size_t max_queue;
+
+        std::mutex queue_mutex;
+        std::condition_variable queue_cond;
+        std::deque<std::function<void()>> queue;
+        bool stopping;
+
+        std::mutex sessions_mutex;
+        std::map<int, Session> sessions;
+        int last_socket;
+
+        std::atomic<unsigned long> send_delay_us;
+        std::atomic<unsigned long> handled;
+        std::atomic<unsigned long> failed;
+        std::atomic<unsigned long> overlapping_sends;
+
+        std::thread thread;
+};
+
+// bytes currently allocated on the heap
+size_t heap_in_use();
+
+}
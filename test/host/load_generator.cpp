@@ -0,0 +1,311 @@
+/* Load generator for Server, running on the fake httpd.
+ *
+ * Opens many websocket sessions, floods them with frames from several producer threads and consumes the data in a
+ * synchronous loop on the main thread, like a sketch's loop() would.  Reports connect and accept latency, throughput,
+ * heap use per session and how long it takes to clean up after all sessions are closed.  Exits with a non-zero
+ * status if any data is lost or anything leaks.
+ *
+ * Usage: load_generator [--proxy=NAME] [--sessions=N] [--producers=N] [--frames=N] [--size=BYTES]
+ *
+ * Proxies: single (default), frame_queue, naive, dynamic, static, shifting, circular
+ */
+
+#include <algorithm>
+#include <atomic>
+#include <chrono>
+#include <string>
+#include <thread>
+#include <vector>
+
+#include <malloc.h>
+#include <unistd.h>
+
+#include <PsychicWebSocketProxy.h>
+
+#include "fake_httpd.h"
+#include "proxies.h"
+
+using namespace PsychicWebSocketProxy;
+
+namespace {
+
+struct Options {
+    std::string proxy = "single";
+    unsigned long sessions = 200;
+    unsigned long producers = 4;
+    unsigned long frames = 100;
+    unsigned long size = 64;
+};
+
+bool parse_option(const char * arg, const char * name, unsigned long & value) {
+    const size_t len = strlen(name);
+    if (strncmp(arg, name, len) || (arg[len] != '=')) {
+        return false;
+    }
+    value = strtoul(arg + len + 1, nullptr, 10);
+    return true;
+}
+
+unsigned long elapsed_us(std::chrono::steady_clock::time_point start) {
+    return std::chrono::duration_cast<std::chrono::microseconds>(std::chrono::steady_clock::now() - start).count();
+}
+
+// Run function(index) for index in [0, count) on the given number of threads
+template <typename Function>
+void run_parallel(unsigned long threads, unsigned long count, Function function) {
+    std::vector<std::thread> workers;
+    for (unsigned long t = 0; t < threads; ++t) {
+        workers.emplace_back([t, threads, count, &function] {
+            for (unsigned long i = t; i < count; i += threads) {
+                function(i);
+            }
+        });
+    }
+    for (auto & worker : workers) {
+        worker.join();
+    }
+}
+
+// Wait until done() returns true.  Gives up and returns false if progress() doesn't change for 5 seconds.
+template <typename Done, typename Progress>
+bool wait_for(Done done, Progress progress) {
+    auto last_progress = progress();
+    auto last_change = std::chrono::steady_clock::now();
+    while (!done()) {
+        const auto current_progress = progress();
+        if (current_progress != last_progress) {
+            last_progress = current_progress;
+            last_change = std::chrono::steady_clock::now();
+        } else if (std::chrono::steady_clock::now() - last_change > std::chrono::seconds(5)) {
+            return false;
+        }
+        std::this_thread::yield();
+    }
+    return true;
+}
+
+// Run the whole scenario once, returns false if any data got lost or corrupted
+bool run(const Options & options, std::function<Proxy *()> factory, bool verbose) {
+    auto report = [verbose](const char * format, auto... args) {
+        if (verbose) {
+            printf(format, args...);
+        }
+    };
+
+    bool ok = true;
+    Server server(factory);
+    fake::Httpd httpd(server);
+    const size_t heap_empty = fake::heap_in_use();
+
+    const unsigned long expected_bytes = options.sessions * options.frames * options.size;
+
+    std::vector<int> sockets(options.sessions);
+    std::vector<unsigned long> connect_latency(options.sessions);
+
+    std::atomic<int> phase(0);   // 0: connecting, 1: sending, 2: disconnecting, 3: done
+    std::atomic<unsigned long> bytes_consumed(0);
+    std::atomic<unsigned long> bytes_corrupted(0);
+    std::atomic<size_t> clients_held(0);
+
+    size_t heap_idle = 0;
+    size_t heap_loaded = 0;
+    unsigned long connect_time_us = 0;
+    unsigned long traffic_time_us = 0;
+    unsigned long cleanup_time_us = 0;
+
+    std::thread driver([&] {
+        // open all sessions
+        auto start = std::chrono::steady_clock::now();
+        run_parallel(options.producers, options.sessions, [&](unsigned long i) {
+            const auto open_start = std::chrono::steady_clock::now();
+            sockets[i] = httpd.open();
+            connect_latency[i] = elapsed_us(open_start);
+        });
+        if (!wait_for([&] { return server.get_stats().connections_accepted >= options.sessions; },
+                      [&] { return server.get_stats().connections_accepted; })) {
+            printf("FAIL: stalled waiting for accept()\n");
+            ok = false;
+        }
+        connect_time_us = elapsed_us(start);
+        heap_idle = fake::heap_in_use();
+
+        // send frames, each producer serves every n-th session
+        phase = 1;
+        start = std::chrono::steady_clock::now();
+        run_parallel(options.producers, options.producers, [&](unsigned long producer) {
+            for (unsigned long frame = 0; frame < options.frames; ++frame) {
+                // each byte carries the frame's sequence number, so that the consumer can verify the data
+                const std::string payload(options.size, char(frame % 251));
+                for (unsigned long i = producer; i < options.sessions; i += options.producers) {
+                    httpd.post(sockets[i], payload);
+                }
+            }
+        });
+        // stop waiting if a session fails, its data will never arrive
+        if (!wait_for([&] { return (bytes_consumed >= expected_bytes) || httpd.frames_failed(); },
+                      [&] { return (unsigned long) bytes_consumed; })) {
+            printf("FAIL: stalled waiting for data\n");
+            ok = false;
+        }
+        traffic_time_us = elapsed_us(start);
+        heap_loaded = fake::heap_in_use();
+
+        // half of the sessions are closed by the peer, the rest by the consumer
+        phase = 2;
+        start = std::chrono::steady_clock::now();
+        run_parallel(options.producers, options.sessions, [&](unsigned long i) {
+            if (i % 2) {
+                httpd.close(sockets[i]);
+            }
+        });
+        auto all_closed = [&] {
+            httpd.sync();
+            return !clients_held && !httpd.session_count()
+                   && (server.get_stats().connections_closed >= options.sessions);
+        };
+        if (!wait_for(all_closed, [&] { return server.get_stats().connections_closed + clients_held; })) {
+            printf("FAIL: stalled waiting for sessions to close\n");
+            ok = false;
+        }
+        cleanup_time_us = elapsed_us(start);
+        phase = 3;
+    });
+
+    // the consumer loop, this is what a sketch's loop() function would do
+    {
+        struct Reader {
+            PsychicWebSocketProxy::Client client;
+            unsigned long position;
+        };
+
+        std::vector<Reader> readers;
+        uint8_t buffer[512];
+        while (phase != 3) {
+            for (auto client = server.accept(); client; client = server.accept()) {
+                readers.push_back(Reader{client, 0});
+            }
+
+            const bool stop_requested = (phase == 2);
+            for (size_t i = 0; i < readers.size(); ++i) {
+                auto & reader = readers[i];
+                while (reader.client.available() > 0) {
+                    const int size = reader.client.read(buffer, sizeof(buffer));
+                    for (int j = 0; j < size; ++j) {
+                        if (buffer[j] != (reader.position++ / options.size) % 251) {
+                            ++bytes_corrupted;
+                        }
+                    }
+                    bytes_consumed += size;
+                }
+                if (stop_requested && reader.client.connected() && (i % 2 == 0)) {
+                    reader.client.stop();
+                }
+            }
+
+            readers.erase(std::remove_if(readers.begin(), readers.end(),
+            [](Reader & reader) { return !reader.client; }), readers.end());
+            clients_held = readers.size();
+            std::this_thread::yield();
+        }
+    }
+
+    driver.join();
+
+    const Server::Stats stats = server.get_stats();
+
+    std::sort(connect_latency.begin(), connect_latency.end());
+    unsigned long connect_latency_total = 0;
+    for (auto latency : connect_latency) {
+        connect_latency_total += latency;
+    }
+
+    const unsigned long frames = options.sessions * options.frames;
+
+    report("connect:  %lu sessions in %lu us, latency avg %lu us, p99 %lu us, max %lu us\n",
+           options.sessions, connect_time_us, connect_latency_total / options.sessions,
+           connect_latency[(options.sessions - 1) * 99 / 100], connect_latency.back());
+    report("accept:   max latency %lu us\n", stats.max_accept_latency_us);
+    report("traffic:  %lu frames, %lu bytes in %lu us, %.0f frames/s, %.0f bytes/s\n",
+           frames, (unsigned long) bytes_consumed, traffic_time_us,
+           traffic_time_us ? frames * 1e6 / traffic_time_us : 0.0,
+           traffic_time_us ? expected_bytes * 1e6 / traffic_time_us : 0.0);
+    report("memory:   %ld bytes per idle session, %ld bytes per session after traffic\n",
+           (long)(heap_idle - heap_empty) / (long) options.sessions,
+           (long)(heap_loaded - heap_empty) / (long) options.sessions);
+    report("cleanup:  %lu sessions closed in %lu us\n", stats.connections_closed, cleanup_time_us);
+
+    if ((bytes_consumed != expected_bytes) || bytes_corrupted) {
+        printf("FAIL: consumed %lu bytes, expected %lu, %lu bytes corrupted\n", (unsigned long) bytes_consumed,
+               expected_bytes, (unsigned long) bytes_corrupted);
+        ok = false;
+    }
+    if ((stats.frames_received != frames) || stats.recv_errors || httpd.frames_failed()) {
+        printf("FAIL: %lu frames received, %lu recv errors, %lu failed frames\n", stats.frames_received,
+               stats.recv_errors, httpd.frames_failed());
+        ok = false;
+    }
+    if ((stats.connections_opened != options.sessions) || (stats.connections_accepted != options.sessions)
+            || (stats.connections_closed != options.sessions)) {
+        printf("FAIL: %lu sessions opened, %lu accepted, %lu closed\n", stats.connections_opened,
+               stats.connections_accepted, stats.connections_closed);
+        ok = false;
+    }
+
+    return ok;
+}
+
+}
+
+int main(int argc, char ** argv) {
+    if (!getenv("GLIBC_TUNABLES")) {
+        // Per-thread caches hold on to freed memory, which mallinfo() reports as used.  Cached thread stacks keep
+        // their TLS blocks allocated, so the heap use after a run would depend on which threads were reused.
+        // Disabling both makes the heap measurements exact.  Tunables are only read at startup, so restart with them
+        // set.
+        setenv("GLIBC_TUNABLES", "glibc.malloc.tcache_count=0:glibc.pthread.stack_cache_size=0", 1);
+        execv("/proc/self/exe", argv);
+    }
+
+    Options options;
+    for (int i = 1; i < argc; ++i) {
+        const char * arg = argv[i];
+        if (!strncmp(arg, "--proxy=", 8)) {
+            options.proxy = arg + 8;
+        } else if (!parse_option(arg, "--sessions", options.sessions)
+                   && !parse_option(arg, "--producers", options.producers)
+                   && !parse_option(arg, "--frames", options.frames)
+                   && !parse_option(arg, "--size", options.size)) {
+            fprintf(stderr, "Unknown option: %s\n", arg);
+            return 2;
+        }
+    }
+
+    auto factory = proxy_factory(options.proxy);
+    if (!factory || !options.sessions || !options.producers || !options.size) {
+        fprintf(stderr, "Invalid options\n");
+        return 2;
+    }
+
+    printf("proxy: %s, sessions: %lu, producers: %lu, frames per session: %lu, frame size: %lu\n",
+           options.proxy.c_str(), options.sessions, options.producers, options.frames, options.size);
+
+    // Make all threads allocate from a single arena, so that heap use doesn't depend on which thread allocates.  The
+    // scenario is run twice, only the second run is reported.  The first one gets one-time allocations (e.g. the
+    // stdio buffers) out of the way, so that any heap growth after the second run is a leak.
+    mallopt(M_ARENA_MAX, 1);
+    bool ok = run(options, factory, false);
+
+    const size_t heap_before = fake::heap_in_use();
+    ok = run(options, factory, true) && ok;
+
+    // everything allocated for the sessions must be gone once the server and httpd are destroyed
+    const long leaked = (long)(fake::heap_in_use() - heap_before);
+    printf("leaked:   %ld bytes\n", leaked);
+    if (leaked > 0) {
+        printf("FAIL: memory leaked\n");
+        ok = false;
+    }
+
+    puts(ok ? "ok" : "FAILED");
+    return ok ? 0 : 1;
+}
@@ -0,0 +1,28 @@
+#pragma once
+
+#include <functional>
+#include <string>
+
+#include <PsychicWebSocketProxy.h>
+
+// Returns a factory creating proxies of the given type with default settings, or nullptr if the name is unknown
+inline std::function<PsychicWebSocketProxy::Proxy *()> proxy_factory(const std::string & name) {
+    using namespace PsychicWebSocketProxy;
+    if (name == "single") {
+        return [] { return new SingleFrameProxy(); };
+    } else if (name == "frame_queue") {
+        return [] { return new FrameQueueProxy(); };
+    } else if (name == "naive") {
+        return [] { return new NaiveProxy(); };
+    } else if (name == "dynamic") {
+        return [] { return new DynamicBufferProxy(); };
+    } else if (name == "static") {
+        return [] { return new StaticBufferProxy(); };
+    } else if (name == "shifting") {
+        return [] { return new ShiftingBufferProxy(); };
+    } else if (name == "circular") {
+        return [] { return new CircularBufferProxy(); };
+    } else {
+        return nullptr;
+    }
+}
@@ -0,0 +1,194 @@
+/* Replay a FrameTracer trace against any Proxy, running on the fake httpd.
+ *
+ * Every connection in the trace is opened again, its frames are delivered with the recorded sizes, types and timing
+ * and the consumer repeats the recorded Client::read() calls.  The replayed server is traced too, which gives the
+ * time spent in Proxy::recv() and its result for every frame.  Reports frames which stalled the httpd task, frames
+ * which timed out or were rejected and the peak heap use.
+ *
+ * Usage: replay [--proxy=NAME] [--speed=FACTOR] [--stall-ms=N] TRACE_FILE
+ *
+ * Proxies: single (default), frame_queue, naive, dynamic, static, shifting, circular
+ */
+
+#include <chrono>
+#include <map>
+#include <string>
+#include <thread>
+#include <vector>
+
+#include <PsychicWebSocketProxy.h>
+
+#include "fake_httpd.h"
+#include "proxies.h"
+
+using namespace PsychicWebSocketProxy;
+
+namespace {
+
+std::vector<FrameTracer::Record> load_trace(const char * path) {
+    std::vector<FrameTracer::Record> records;
+    FILE * file = fopen(path, "rb");
+    if (!file) {
+        return records;
+    }
+    FrameTracer::Record record;
+    while (fread(&record, sizeof(record), 1, file) == 1) {
+        records.push_back(record);
+    }
+    fclose(file);
+    return records;
+}
+
+// Collects the RECV records of the replayed server
+class RecvStats: public Print {
+    public:
+        RecvStats(unsigned long stall_us): stall_us(stall_us), frames(0), stalls(0), max_recv_us(0) {}
+
+        virtual size_t write(uint8_t c) override { return 0; }
+
+        virtual size_t write(const uint8_t * buffer, size_t size) override {
+            const FrameTracer::Record * records = (const FrameTracer::Record *) buffer;
+            for (size_t i = 0; i < size / sizeof(FrameTracer::Record); ++i) {
+                const FrameTracer::Record & record = records[i];
+                if (record.event != FrameTracer::RECV) {
+                    continue;
+                }
+                ++frames;
+                max_recv_us = std::max(max_recv_us, (unsigned long) record.a);
+                if (record.a >= stall_us) {
+                    ++stalls;
+                }
+                if ((esp_err_t) record.b != ESP_OK) {
+                    ++errors[(esp_err_t) record.b];
+                }
+            }
+            return size;
+        }
+
+        const unsigned long stall_us;
+        unsigned long frames;
+        unsigned long stalls;
+        unsigned long max_recv_us;
+        std::map<esp_err_t, unsigned long> errors;
+};
+
+struct Connection {
+    int socket;
+    PsychicWebSocketProxy::Client client;
+};
+
+}
+
+int main(int argc, char ** argv) {
+    std::string proxy = "single";
+    double speed = 1.0;
+    unsigned long stall_ms = 100;
+    const char * path = nullptr;
+    for (int i = 1; i < argc; ++i) {
+        const char * arg = argv[i];
+        if (!strncmp(arg, "--proxy=", 8)) {
+            proxy = arg + 8;
+        } else if (!strncmp(arg, "--speed=", 8)) {
+            speed = atof(arg + 8);
+        } else if (!strncmp(arg, "--stall-ms=", 11)) {
+            stall_ms = strtoul(arg + 11, nullptr, 10);
+        } else if (arg[0] != '-' && !path) {
+            path = arg;
+        } else {
+            fprintf(stderr, "Unknown option: %s\n", arg);
+            return 2;
+        }
+    }
+
+    auto factory = proxy_factory(proxy);
+    if (!factory || !path || (speed <= 0)) {
+        fprintf(stderr, "Usage: replay [--proxy=NAME] [--speed=FACTOR] [--stall-ms=N] TRACE_FILE\n");
+        return 2;
+    }
+
+    const auto records = load_trace(path);
+    if (records.empty()) {
+        fprintf(stderr, "Can't read trace from %s\n", path);
+        return 2;
+    }
+
+    RecvStats recv_stats(stall_ms * 1000);
+    FrameTracer tracer(recv_stats);
+    Server server(factory);
+    server.set_tracer(&tracer);
+    fake::Httpd httpd(server);
+
+    const size_t heap_start = fake::heap_in_use();
+    size_t heap_peak = heap_start;
+
+    std::map<uint16_t, Connection> connections;
+    std::vector<uint8_t> buffer;
+    unsigned long frames = 0;
+    unsigned long bytes_recorded = 0;
+    unsigned long bytes_replayed = 0;
+
+    // timestamps are micros() values, which wrap around, so only differences are meaningful
+    const auto start = std::chrono::steady_clock::now();
+    uint64_t trace_time_us = 0;
+    uint32_t last_timestamp = records.front().timestamp;
+
+    for (const auto & record : records) {
+        trace_time_us += (uint32_t)(record.timestamp - last_timestamp);
+        last_timestamp = record.timestamp;
+        std::this_thread::sleep_until(start + std::chrono::microseconds(uint64_t(trace_time_us / speed)));
+
+        auto it = connections.find(record.connection);
+        switch (record.event) {
+            case FrameTracer::OPEN: {
+                const int socket = httpd.open();
+                connections[record.connection] = Connection{socket, server.accept()};
+                break;
+            }
+            case FrameTracer::FRAME:
+                if (it != connections.end()) {
+                    httpd.post(it->second.socket, std::string(record.a, 'x'), (httpd_ws_type_t) record.type);
+                    ++frames;
+                }
+                break;
+            case FrameTracer::READ:
+                if (it != connections.end()) {
+                    buffer.resize(std::max(buffer.size(), (size_t) record.a));
+                    const int ret = it->second.client.read(buffer.data(), record.a);
+                    bytes_recorded += record.b;
+                    bytes_replayed += ret > 0 ? ret : 0;
+                }
+                break;
+            case FrameTracer::CLOSE:
+                if (it != connections.end()) {
+                    // don't wait, the httpd task may be blocked until the consumer reads more data
+                    httpd.trigger_close(it->second.socket);
+                    connections.erase(it);
+                }
+                break;
+            default:
+                break;
+        }
+
+        heap_peak = std::max(heap_peak, fake::heap_in_use());
+        tracer.flush();
+    }
+
+    connections.clear();
+    httpd.sync();
+    tracer.flush();
+
+    printf("proxy:    %s\n", proxy.c_str());
+    printf("replayed: %zu records, %lu frames in %lu ms (recorded: %lu ms)\n", records.size(), frames,
+           (unsigned long) std::chrono::duration_cast<std::chrono::milliseconds>(
+               std::chrono::steady_clock::now() - start).count(),
+           (unsigned long)(trace_time_us / 1000));
+    printf("reads:    %lu bytes read, %lu bytes in the recorded reads\n", bytes_replayed, bytes_recorded);
+    printf("recv:     %lu frames, max %lu us, %lu stalls over %lu ms\n", recv_stats.frames, recv_stats.max_recv_us,
+           recv_stats.stalls, stall_ms);
+    for (const auto & error : recv_stats.errors) {
+        printf("errors:   %lu x %s\n", error.second, esp_err_to_name(error.first));
+    }
+    printf("memory:   peak %ld bytes above start\n", (long)(heap_peak - heap_start));
+
+    return 0;
+}
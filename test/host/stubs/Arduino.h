@@ -0,0 +1,87 @@
+#pragma once
+
+/* Minimal stand-in for the ESP32 Arduino core, just enough to build the library on a Linux host.  Only the parts
+ * used by PsychicWebSocketProxy are provided.
+ */
+
+#include <cstddef>
+#include <cstdint>
+#include <cstdio>
+#include <cstdlib>
+#include <cstring>
+
+typedef int esp_err_t;
+
+#define ESP_OK 0
+#define ESP_FAIL -1
+#define ESP_ERR_NO_MEM 0x101
+#define ESP_ERR_INVALID_ARG 0x102
+#define ESP_ERR_INVALID_STATE 0x103
+#define ESP_ERR_INVALID_SIZE 0x104
+#define ESP_ERR_TIMEOUT 0x107
+
+const char * esp_err_to_name(esp_err_t code);
+
+// Logging is silenced unless FAKE_LOG is set in the environment
+void fake_log(char level, const char * tag, const char * format, ...) __attribute__((format(printf, 3, 4)));
+#define ESP_LOGE(tag, ...) fake_log('E', tag, __VA_ARGS__)
+#define ESP_LOGW(tag, ...) fake_log('W', tag, __VA_ARGS__)
+#define ESP_LOGI(tag, ...) fake_log('I', tag, __VA_ARGS__)
+#define ESP_LOGD(tag, ...) fake_log('D', tag, __VA_ARGS__)
+
+#define MALLOC_CAP_8BIT (1 << 2)
+#define MALLOC_CAP_SPIRAM (1 << 10)
+
+inline void * heap_caps_malloc(size_t size, uint32_t caps) { return malloc(size); }
+
+unsigned long millis();
+unsigned long micros();
+void delay(uint32_t ms);
+
+class IPAddress {};
+
+class Print {
+    public:
+        virtual ~Print() {}
+        virtual size_t write(uint8_t c) = 0;
+        virtual size_t write(const uint8_t * buffer, size_t size);
+        size_t write(const char * str) { return write((const uint8_t *) str, strlen(str)); }
+        virtual void flush() {}
+};
+
+class Stream: public Print {
+    public:
+        Stream(): _timeout(1000) {}
+
+        virtual int available() = 0;
+        virtual int read() = 0;
+        virtual int peek() = 0;
+
+        void setTimeout(unsigned long timeout) { _timeout = timeout; }
+        unsigned long getTimeout() { return _timeout; }
+
+        virtual size_t readBytes(char * buffer, size_t length);
+        size_t readBytes(uint8_t * buffer, size_t length) { return readBytes((char *) buffer, length); }
+
+    protected:
+        int timedRead();
+        int timedPeek();
+
+        unsigned long _timeout;
+};
+
+class Client: public Stream {
+    public:
+        virtual int connect(IPAddress ip, uint16_t port) = 0;
+        virtual int connect(const char * host, uint16_t port) = 0;
+        virtual size_t write(uint8_t c) = 0;
+        virtual size_t write(const uint8_t * buffer, size_t size) = 0;
+        virtual int available() = 0;
+        virtual int read() = 0;
+        virtual int read(uint8_t * buffer, size_t size) = 0;
+        virtual int peek() = 0;
+        virtual void flush() = 0;
+        virtual void stop() = 0;
+        virtual uint8_t connected() = 0;
+        virtual operator bool() = 0;
+};
@@ -0,0 +1,119 @@
+#pragma once
+
+/* PsychicHttp and ESP-IDF httpd stand-in.  The classes mirror the parts of the PsychicHttp API used by the library.
+ * The httpd functions are implemented by fake::Httpd (see fake_httpd.h), which plays the role of the httpd task.
+ */
+
+#include <list>
+
+#include <Arduino.h>
+
+#define PH_TAG "psychic"
+
+typedef void * httpd_handle_t;
+
+typedef struct httpd_req {
+    httpd_handle_t handle;
+    void * aux;     // the fake::Frame being handled
+} httpd_req_t;
+
+typedef enum {
+    HTTPD_WS_TYPE_CONTINUE = 0x0,
+    HTTPD_WS_TYPE_TEXT = 0x1,
+    HTTPD_WS_TYPE_BINARY = 0x2,
+    HTTPD_WS_TYPE_CLOSE = 0x8,
+    HTTPD_WS_TYPE_PING = 0x9,
+    HTTPD_WS_TYPE_PONG = 0xA,
+} httpd_ws_type_t;
+
+typedef struct httpd_ws_frame {
+    bool final;
+    bool fragmented;
+    httpd_ws_type_t type;
+    uint8_t * payload;
+    size_t len;
+} httpd_ws_frame_t;
+
+typedef void (*httpd_work_fn_t)(void * arg);
+
+// Like on ESP-IDF, the payload can't be read in parts: max_len == 0 reads the header, anything else the whole payload.
+esp_err_t httpd_ws_recv_frame(httpd_req_t * req, httpd_ws_frame_t * frame, size_t max_len);
+esp_err_t httpd_sess_trigger_close(httpd_handle_t handle, int sockfd);
+esp_err_t httpd_queue_work(httpd_handle_t handle, httpd_work_fn_t work, void * arg);
+
+enum http_method {
+    HTTP_GET = 1,
+    HTTP_POST = 3,
+};
+
+class PsychicClient {
+    public:
+        PsychicClient(httpd_handle_t server, int socket): _friend(nullptr), isNew(false), _server(server),
+            _socket(socket) {}
+        virtual ~PsychicClient() {}
+
+        httpd_handle_t server() { return _server; }
+        int socket() { return _socket; }
+        esp_err_t close() { return httpd_sess_trigger_close(_server, _socket); }
+
+        void * _friend;
+        bool isNew;
+
+    protected:
+        httpd_handle_t _server;
+        int _socket;
+};
+
+class PsychicWebSocketClient: public PsychicClient {
+    public:
+        PsychicWebSocketClient(PsychicClient * client): PsychicClient(client->server(), client->socket()) {}
+
+        esp_err_t sendMessage(httpd_ws_frame_t * frame) { return sendMessage(frame->type, frame->payload, frame->len); }
+        esp_err_t sendMessage(httpd_ws_type_t op, const void * data, size_t len);
+};
+
+class PsychicRequest {
+    public:
+        PsychicRequest(PsychicClient * client, http_method method, httpd_req_t * req): _client(client),
+            _method(method), _req(req) {}
+
+        PsychicClient * client() { return _client; }
+        http_method method() { return _method; }
+        httpd_req_t * request() { return _req; }
+
+    protected:
+        PsychicClient * _client;
+        http_method _method;
+        httpd_req_t * _req;
+};
+
+class PsychicWebSocketRequest: public PsychicRequest {
+    public:
+        PsychicWebSocketRequest(PsychicRequest * request): PsychicRequest(*request) {}
+};
+
+class PsychicHandler {
+    public:
+        virtual ~PsychicHandler() {}
+
+        virtual esp_err_t handleRequest(PsychicRequest * request) = 0;
+        virtual void openCallback(PsychicClient * client) {}
+        virtual void closeCallback(PsychicClient * client) {}
+
+        // called by the httpd when a session closes
+        void checkForClosedClient(PsychicClient * client);
+
+        virtual void addClient(PsychicClient * client) { _clients.push_back(client); }
+        virtual void removeClient(PsychicClient * client) { _clients.remove(client); }
+        bool hasClient(PsychicClient * client);
+        PsychicClient * checkForNewClient(PsychicClient * client);
+        const std::list<PsychicClient *> & getClientList() { return _clients; }
+
+    protected:
+        std::list<PsychicClient *> _clients;
+};
+
+class PsychicWebSocketHandler: public PsychicHandler {
+    public:
+        PsychicWebSocketClient * getClient(PsychicClient * client) { return (PsychicWebSocketClient *) client->_friend; }
+};
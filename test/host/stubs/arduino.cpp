@@ -0,0 +1,99 @@
+#include <chrono>
+#include <cstdarg>
+#include <thread>
+
+#include <Arduino.h>
+
+static const auto start_time = std::chrono::steady_clock::now();
+
+unsigned long millis() {
+    return std::chrono::duration_cast<std::chrono::milliseconds>(std::chrono::steady_clock::now() - start_time).count();
+}
+
+unsigned long micros() {
+    return std::chrono::duration_cast<std::chrono::microseconds>(std::chrono::steady_clock::now() - start_time).count();
+}
+
+void delay(uint32_t ms) {
+    std::this_thread::sleep_for(std::chrono::milliseconds(ms));
+}
+
+const char * esp_err_to_name(esp_err_t code) {
+    switch (code) {
+        case ESP_OK:
+            return "ESP_OK";
+        case ESP_FAIL:
+            return "ESP_FAIL";
+        case ESP_ERR_NO_MEM:
+            return "ESP_ERR_NO_MEM";
+        case ESP_ERR_INVALID_ARG:
+            return "ESP_ERR_INVALID_ARG";
+        case ESP_ERR_INVALID_STATE:
+            return "ESP_ERR_INVALID_STATE";
+        case ESP_ERR_INVALID_SIZE:
+            return "ESP_ERR_INVALID_SIZE";
+        case ESP_ERR_TIMEOUT:
+            return "ESP_ERR_TIMEOUT";
+        default:
+            return "UNKNOWN ERROR";
+    }
+}
+
+void fake_log(char level, const char * tag, const char * format, ...) {
+    static const bool enabled = getenv("FAKE_LOG");
+    if (!enabled) {
+        return;
+    }
+    va_list args;
+    va_start(args, format);
+    fprintf(stderr, "%c (%lu) %s: ", level, millis(), tag);
+    vfprintf(stderr, format, args);
+    fputc('\n', stderr);
+    va_end(args);
+}
+
+size_t Print::write(const uint8_t * buffer, size_t size) {
+    size_t n = 0;
+    while (size--) {
+        if (!write(*buffer++)) {
+            break;
+        }
+        ++n;
+    }
+    return n;
+}
+
+int Stream::timedRead() {
+    const unsigned long start = millis();
+    do {
+        const int c = read();
+        if (c >= 0) {
+            return c;
+        }
+    } while (millis() - start < _timeout);
+    return -1;
+}
+
+int Stream::timedPeek() {
+    const unsigned long start = millis();
+    do {
+        const int c = peek();
+        if (c >= 0) {
+            return c;
+        }
+    } while (millis() - start < _timeout);
+    return -1;
+}
+
+size_t Stream::readBytes(char * buffer, size_t length) {
+    size_t count = 0;
+    while (count < length) {
+        const int c = timedRead();
+        if (c < 0) {
+            break;
+        }
+        *buffer++ = (char) c;
+        count++;
+    }
+    return count;
+}
@@ -0,0 +1,79 @@
+#include <chrono>
+#include <condition_variable>
+#include <mutex>
+#include <thread>
+
+#include <esp_timer.h>
+
+struct esp_timer {
+    esp_timer_cb_t callback;
+    void * arg;
+    std::mutex mutex;
+    std::condition_variable cond;
+    bool running;
+    std::thread thread;
+};
+
+esp_err_t esp_timer_create(const esp_timer_create_args_t * args, esp_timer_handle_t * handle) {
+    esp_timer * timer = new esp_timer();
+    timer->callback = args->callback;
+    timer->arg = args->arg;
+    timer->running = false;
+    *handle = timer;
+    return ESP_OK;
+}
+
+esp_err_t esp_timer_start_periodic(esp_timer_handle_t timer, uint64_t period_us) {
+    {
+        const std::lock_guard<std::mutex> lock(timer->mutex);
+        if (timer->running) {
+            return ESP_ERR_INVALID_STATE;
+        }
+        timer->running = true;
+    }
+    if (timer->thread.joinable()) {
+        timer->thread.join();
+    }
+    timer->thread = std::thread([timer, period_us] {
+        std::unique_lock<std::mutex> lock(timer->mutex);
+        while (true) {
+            if (timer->cond.wait_for(lock, std::chrono::microseconds(period_us), [timer] { return !timer->running; })) {
+                return;
+            }
+            lock.unlock();
+            timer->callback(timer->arg);
+            lock.lock();
+        }
+    });
+    return ESP_OK;
+}
+
+esp_err_t esp_timer_stop(esp_timer_handle_t timer) {
+    {
+        const std::lock_guard<std::mutex> lock(timer->mutex);
+        if (!timer->running) {
+            return ESP_ERR_INVALID_STATE;
+        }
+        timer->running = false;
+    }
+    timer->cond.notify_all();
+    if (timer->thread.joinable() && (timer->thread.get_id() != std::this_thread::get_id())) {
+        timer->thread.join();
+    }
+    return ESP_OK;
+}
+
+esp_err_t esp_timer_delete(esp_timer_handle_t timer) {
+    if (timer->running) {
+        return ESP_ERR_INVALID_STATE;
+    }
+    if (timer->thread.joinable()) {
+        timer->thread.join();
+    }
+    delete timer;
+    return ESP_OK;
+}
+
+int64_t esp_timer_get_time() {
+    return micros();
+}
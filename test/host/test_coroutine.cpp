@@ -0,0 +1,160 @@
+// Tests of the coroutine interface, the echo handler is the example from coroutine.h
+
+#include <PsychicWebSocketProxy.h>
+
+#include "check.h"
+#include "fake_httpd.h"
+
+PsychicWebSocketProxy::Server websocket_handler;
+
+// --- example from coroutine.h ---
+
+PsychicWebSocketProxy::Scheduler scheduler;
+
+PsychicWebSocketProxy::Task echo(PsychicWebSocketProxy::Client client) {
+    uint8_t buffer[64];
+    while (true) {
+        const size_t size = co_await scheduler.read_some(client, buffer, sizeof(buffer));
+        if (!size) {
+            break;  // disconnected
+        }
+        client.write(buffer, size);
+    }
+}
+
+void loop() {
+    auto client = websocket_handler.accept();
+    if (client) {
+        scheduler.spawn(echo(client));
+    }
+    scheduler.run_pending();
+}
+
+// --- end of example ---
+
+static std::string sent_payloads(fake::Httpd & httpd, int socket) {
+    std::string ret;
+    for (const auto & frame : httpd.sent(socket)) {
+        ret += frame.payload;
+    }
+    return ret;
+}
+
+static void test_echo_example() {
+    fake::Httpd httpd(websocket_handler);
+
+    // the coroutine starts before any data arrives
+    const int first = httpd.open();
+    loop();
+    CHECK(httpd.send(first, "hello") == ESP_OK);
+    loop();
+    CHECK(sent_payloads(httpd, first) == "hello");
+
+    // data is already waiting when the coroutine starts
+    const int second = httpd.open();
+    CHECK(httpd.send(second, "abc") == ESP_OK);
+    loop();
+    CHECK(sent_payloads(httpd, second) == "abc");
+
+    // frames larger than the coroutine's buffer are echoed in parts
+    const std::string large(150, 'x');
+    CHECK(httpd.send(first, large) == ESP_OK);
+    for (int i = 0; i < 3; ++i) {
+        loop();
+    }
+    CHECK(sent_payloads(httpd, first) == "hello" + large);
+
+    // the coroutines finish when the connections drop, the sanitizers report a leak otherwise
+    httpd.close(first);
+    httpd.close(second);
+    loop();
+    CHECK(!websocket_handler.accept());
+    CHECK(websocket_handler.get_stats().connections_closed == 2);
+}
+
+static PsychicWebSocketProxy::Task read_exact(PsychicWebSocketProxy::Scheduler & scheduler,
+        PsychicWebSocketProxy::Client client, std::string & result) {
+    uint8_t buffer[8];
+    const size_t size = co_await scheduler.read(client, buffer, sizeof(buffer));
+    result.assign((const char *) buffer, size);
+}
+
+static void test_read_spans_frames() {
+    PsychicWebSocketProxy::Server server;
+    PsychicWebSocketProxy::Scheduler scheduler;
+    fake::Httpd httpd(server);
+
+    const int socket = httpd.open();
+    std::string result;
+    scheduler.spawn(read_exact(scheduler, server.accept(), result));
+    scheduler.run_pending();
+
+    CHECK(httpd.send(socket, "abc") == ESP_OK);
+    scheduler.run_pending();
+    CHECK(result.empty());
+
+    CHECK(httpd.send(socket, "defghij") == ESP_OK);
+    scheduler.run_pending();
+    CHECK(result == "abcdefgh");
+}
+
+static void test_read_completes_on_disconnect() {
+    PsychicWebSocketProxy::Server server;
+    PsychicWebSocketProxy::Scheduler scheduler;
+    fake::Httpd httpd(server);
+
+    const int socket = httpd.open();
+    std::string result = "not set";
+    scheduler.spawn(read_exact(scheduler, server.accept(), result));
+    scheduler.run_pending();
+
+    CHECK(httpd.send(socket, "ab") == ESP_OK);
+    httpd.close(socket);
+    scheduler.run_pending();
+    CHECK(result == "ab");
+}
+
+static PsychicWebSocketProxy::Task count_bytes(PsychicWebSocketProxy::Scheduler & scheduler,
+        PsychicWebSocketProxy::Client client, std::atomic<size_t> & count) {
+    uint8_t buffer[16];
+    while (size_t size = co_await scheduler.read_some(client, buffer, sizeof(buffer))) {
+        count += size;
+    }
+}
+
+static void test_no_lost_wakeups() {
+    // frames arrive from the httpd task while the coroutine registers and cancels its receive callback
+    PsychicWebSocketProxy::Server server;
+    PsychicWebSocketProxy::Scheduler scheduler;
+    fake::Httpd httpd(server);
+
+    const int socket = httpd.open();
+    std::atomic<size_t> count(0);
+    scheduler.spawn(count_bytes(scheduler, server.accept(), count));
+
+    const size_t frames = 2000;
+    std::thread producer([&] {
+        for (size_t i = 0; i < frames; ++i) {
+            httpd.post(socket, "0123456789");
+        }
+    });
+
+    const unsigned long start = millis();
+    while ((count < frames * 10) && (millis() - start < 5000)) {
+        scheduler.run(10);
+    }
+    producer.join();
+    CHECK(count == frames * 10);
+
+    httpd.close(socket);
+    scheduler.run_pending();
+}
+
+int main() {
+    test_echo_example();
+    test_read_spans_frames();
+    test_read_completes_on_disconnect();
+    test_no_lost_wakeups();
+    puts("ok");
+    return 0;
+}
@@ -0,0 +1,289 @@
+// Tests run against every buffering proxy type
+
+#include <functional>
+#include <string>
+#include <utility>
+#include <thread>
+
+#include <PsychicWebSocketProxy.h>
+
+#include "check.h"
+#include "fake_httpd.h"
+#include "proxies.h"
+
+using namespace PsychicWebSocketProxy;
+
+static const char * const proxy_names[] = {
+    "single", "frame_queue", "naive", "dynamic", "static", "shifting", "circular",
+};
+
+// available() and connected() don't take the proxy's lock, they must stay consistent while the httpd task writes
+static void test_concurrent_reader_and_writer(const char * proxy_name) {
+    Server server(proxy_factory(proxy_name));
+    fake::Httpd httpd(server);
+
+    const int socket = httpd.open();
+    PsychicWebSocketProxy::Client client = server.accept();
+
+    const size_t frames = 2000;
+    const std::string payload = "0123456789";
+    std::thread producer([&] {
+        for (size_t i = 0; i < frames; ++i) {
+            httpd.post(socket, payload);
+        }
+    });
+
+    // read in chunks, which don't line up with the frames
+    size_t total = 0;
+    char buffer[7];
+    const unsigned long start = millis();
+    while ((total < frames * payload.size()) && (millis() - start < 10000)) {
+        const int available = client.available();
+        CHECK(available >= 0);
+        CHECK(client.connected());
+        if (available) {
+            const int size = client.read((uint8_t *) buffer, sizeof(buffer));
+            CHECK(size > 0);
+            CHECK(size <= available);
+            for (int i = 0; i < size; ++i) {
+                CHECK(buffer[i] == payload[(total + i) % payload.size()]);
+            }
+            total += size;
+        }
+    }
+    producer.join();
+    CHECK(total == frames * payload.size());
+    CHECK(httpd.frames_failed() == 0);
+
+    httpd.sync();
+    CHECK(client.available() == 0);
+    httpd.close(socket);
+    CHECK(!client.connected());
+    CHECK(!client);
+}
+
+// Blocking reads must sleep until data arrives or the connection drops, not until the timeout expires
+static void test_timed_reads(std::function<Proxy *()> factory) {
+    Server server(factory);
+    fake::Httpd httpd(server);
+
+    const int socket = httpd.open();
+    PsychicWebSocketProxy::Client client = server.accept();
+    char buffer[8];
+
+    // no data, all of them time out
+    client.setTimeout(20);
+    unsigned long start = millis();
+    CHECK(client.timedRead() == -1);
+    CHECK(client.timedPeek() == -1);
+    CHECK(client.readBytes(buffer, sizeof(buffer)) == 0);
+    CHECK(millis() - start >= 60);
+
+    // a frame arriving wakes them up
+    client.setTimeout(5000);
+    std::thread sender([&] {
+        delay(20);
+        httpd.post(socket, "ab");
+        delay(20);
+        httpd.post(socket, "cd");
+        delay(20);
+        httpd.post(socket, "ef");
+    });
+    start = millis();
+    CHECK(client.timedPeek() == 'a');
+    CHECK(client.timedRead() == 'a');
+    CHECK(client.timedRead() == 'b');
+    CHECK(client.readBytes(buffer, 4) == 4);
+    CHECK(std::string(buffer, 4) == "cdef");
+    CHECK(millis() - start < 2000);
+    sender.join();
+
+    // and so does the connection dropping
+    std::thread closer([&] {
+        delay(20);
+        httpd.close(socket);
+    });
+    start = millis();
+    CHECK(client.timedRead() == -1);
+    CHECK(millis() - start < 2000);
+    closer.join();
+
+    start = millis();
+    CHECK(client.readBytes(buffer, sizeof(buffer)) == 0);
+    CHECK(client.timedPeek() == -1);
+    CHECK(millis() - start < 2000);
+}
+
+static std::string read_exactly(PsychicWebSocketProxy::Client & client, size_t size) {
+    std::string ret(size, 0);
+    ret.resize(client.readBytes(&ret[0], size));
+    return ret;
+}
+
+// Proxies with a 16 byte buffer, which spill frames of up to 8 kB
+static const size_t spill_buffer_size = 16;
+static const size_t spill_limit = 8192;
+
+static const std::pair<const char *, std::function<Proxy *()>> spill_factories[] = {
+    {"static", [] { return new StaticBufferProxy(spill_buffer_size, 500, ESP_ERR_NO_MEM, spill_limit); }},
+    {"shifting", [] { return new ShiftingBufferProxy(spill_buffer_size, 500, ESP_ERR_NO_MEM, spill_limit); }},
+    {"circular", [] { return new CircularBufferProxy(spill_buffer_size, 500, ESP_ERR_NO_MEM, spill_limit); }},
+    {"dynamic", [] { return new DynamicBufferProxy(spill_buffer_size, 500, ESP_ERR_NO_MEM, spill_limit); }},
+};
+
+static void test_spill_order(std::function<Proxy *()> factory) {
+    Server server(factory);
+    fake::Httpd httpd(server);
+
+    const int socket = httpd.open();
+    PsychicWebSocketProxy::Client client = server.accept();
+    client.setTimeout(2000);
+
+    // frames of the buffer's size fit in it or get spilled, either way they're accepted
+    const std::string full(spill_buffer_size, 'f');
+    CHECK(httpd.send(socket, full) == ESP_OK);
+    CHECK(read_exactly(client, full.size()) == full);
+    CHECK(httpd.send(socket, "next") == ESP_OK);
+    CHECK(read_exactly(client, 4) == "next");
+
+    // the oversize frame is read after the data received before it and before the data received after it
+    const std::string large(100, 'L');
+    CHECK(httpd.send(socket, "abc") == ESP_OK);
+    CHECK(httpd.send(socket, large) == ESP_OK);
+    httpd.post(socket, "def");
+    CHECK(client.peek() == 'a');
+    CHECK(read_exactly(client, 3) == "abc");
+    CHECK(client.peek() == 'L');
+    CHECK(read_exactly(client, large.size()) == large);
+    CHECK(read_exactly(client, 3) == "def");
+
+    httpd.sync();
+    CHECK(client.available() == 0);
+    CHECK(httpd.frames_failed() == 0);
+}
+
+static void test_spill_freed_when_consumed(std::function<Proxy *()> factory) {
+    Server server(factory);
+    fake::Httpd httpd(server);
+
+    const int socket = httpd.open();
+    PsychicWebSocketProxy::Client client = server.accept();
+    client.setTimeout(2000);
+
+    const std::string large(4000, 'L');
+    CHECK(httpd.send(socket, large) == ESP_OK);
+    CHECK(read_exactly(client, 10) == large.substr(0, 10));
+#if !defined(__SANITIZE_ADDRESS__) && !defined(__SANITIZE_THREAD__)
+    const size_t heap_before = fake::heap_in_use();
+    CHECK(read_exactly(client, large.size() - 10) == large.substr(10));
+    CHECK(heap_before - fake::heap_in_use() >= large.size());
+#else
+    // the sanitizers replace malloc, heap_in_use() doesn't work with them
+    CHECK(read_exactly(client, large.size() - 10) == large.substr(10));
+#endif
+    CHECK(client.available() == 0);
+
+    // the next oversize frame doesn't have to wait
+    const unsigned long start = millis();
+    CHECK(httpd.send(socket, large) == ESP_OK);
+    CHECK(millis() - start < 250);
+    CHECK(read_exactly(client, large.size()) == large);
+}
+
+static void test_spill_limit(std::function<Proxy *()> factory) {
+    Server server(factory);
+    fake::Httpd httpd(server);
+
+    const int socket = httpd.open();
+    PsychicWebSocketProxy::Client client = server.accept();
+
+    // frames above the limit fail right away instead of after the timeout
+    const unsigned long start = millis();
+    CHECK(httpd.send(socket, std::string(spill_limit + 1, 'x')) == ESP_ERR_NO_MEM);
+    CHECK(millis() - start < 250);
+    CHECK(!httpd.is_open(socket));
+    CHECK(!client.connected());
+}
+
+static void test_dynamic_single_spill_chunk() {
+    Server server(spill_factories[3].second);
+    fake::Httpd httpd(server);
+
+    const int socket = httpd.open();
+    PsychicWebSocketProxy::Client client = server.accept();
+    client.setTimeout(2000);
+
+    const std::string first(100, '1');
+    const std::string second(200, '2');
+    CHECK(httpd.send(socket, first) == ESP_OK);
+    // the spill chunk doesn't count towards max_size, regular frames are still queued
+    CHECK(httpd.send(socket, "abc") == ESP_OK);
+    CHECK(client.available() == int(first.size() + 3));
+
+    // the second oversize frame waits until the first one is consumed
+    httpd.post(socket, second);
+    delay(50);
+    CHECK(client.available() == int(first.size() + 3));
+    CHECK(read_exactly(client, first.size()) == first);
+    CHECK(read_exactly(client, 3) == "abc");
+    CHECK(read_exactly(client, second.size()) == second);
+
+    // and it fails if the first one isn't consumed in time
+    CHECK(httpd.send(socket, first) == ESP_OK);
+    CHECK(httpd.send(socket, second) == ESP_ERR_NO_MEM);
+    CHECK(!httpd.is_open(socket));
+}
+
+// A proxy written against the original interface, which only implemented available(), read(), peek() and recv()
+class LegacyProxy: public Proxy {
+    public:
+        virtual esp_err_t recv(httpd_req_t * request, httpd_ws_frame_t * frame) override {
+            std::string payload(frame->len, 0);
+            frame->payload = (uint8_t *) &payload[0];
+            const esp_err_t ret = httpd_ws_recv_frame(request, frame, frame->len);
+            if (ret == ESP_OK) {
+                const std::lock_guard<std::mutex> lock(mutex);
+                data += payload;
+            }
+            return ret;
+        }
+
+        virtual int available() override {
+            const std::lock_guard<std::mutex> lock(mutex);
+            return data.size();
+        }
+
+        virtual int read(uint8_t * buffer, size_t size) override {
+            const std::lock_guard<std::mutex> lock(mutex);
+            size = std::min(size, data.size());
+            memcpy(buffer, data.data(), size);
+            data.erase(0, size);
+            return size;
+        }
+
+        virtual int peek() override {
+            const std::lock_guard<std::mutex> lock(mutex);
+            return data.empty() ? -1 : (uint8_t) data[0];
+        }
+
+    protected:
+        std::mutex mutex;
+        std::string data;
+};
+
+int main() {
+    for (const char * proxy_name : proxy_names) {
+        test_concurrent_reader_and_writer(proxy_name);
+        test_timed_reads(proxy_factory(proxy_name));
+    }
+    for (const auto & spill_factory : spill_factories) {
+        test_spill_order(spill_factory.second);
+        test_spill_freed_when_consumed(spill_factory.second);
+        test_spill_limit(spill_factory.second);
+    }
+    test_dynamic_single_spill_chunk();
+    // proxies, which don't signal data changes, are polled
+    test_timed_reads([] { return new LegacyProxy(); });
+    puts("ok");
+    return 0;
+}
@@ -0,0 +1,630 @@
+// End-to-end tests of Server driven through the fake httpd
+
+#include <thread>
+
+#include <PsychicWebSocketProxy.h>
+
+#include "check.h"
+#include "fake_httpd.h"
+
+using namespace PsychicWebSocketProxy;
+
+static std::string read_all(PsychicWebSocketProxy::Client & client) {
+    std::string ret;
+    char buffer[16];
+    while (client.available() > 0) {
+        const int size = client.read((uint8_t *) buffer, sizeof(buffer));
+        CHECK(size > 0);
+        ret.append(buffer, size);
+    }
+    return ret;
+}
+
+static void test_accept_and_exchange() {
+    Server server;
+    fake::Httpd httpd(server);
+
+    CHECK(!server.accept());
+
+    const int socket = httpd.open();
+    PsychicWebSocketProxy::Client client = server.accept();
+    CHECK(client);
+    CHECK(client.connected());
+    CHECK(!server.accept());
+
+    CHECK(httpd.send(socket, "hello") == ESP_OK);
+    CHECK(client.available() == 5);
+    CHECK(read_all(client) == "hello");
+
+    CHECK(client.write((const uint8_t *) "world", 5) == 5);
+    const auto sent = httpd.sent(socket);
+    CHECK(sent.size() == 1);
+    CHECK(sent[0].type == HTTPD_WS_TYPE_BINARY);
+    CHECK(sent[0].payload == "world");
+
+    // empty frames are accepted and ignored
+    CHECK(httpd.send(socket, "") == ESP_OK);
+    CHECK(client.available() == 0);
+}
+
+static void test_read_empty() {
+    const std::vector<std::function<Proxy *()>> factories = {
+        [] { return new SingleFrameProxy(); },
+        [] { return new FrameQueueProxy(); },
+        [] { return new NaiveProxy(); },
+        [] { return new DynamicBufferProxy(); },
+        [] { return new StaticBufferProxy(); },
+        [] { return new ShiftingBufferProxy(); },
+        [] { return new CircularBufferProxy(); },
+    };
+
+    for (const auto & factory : factories) {
+        Server server(factory);
+        fake::Httpd httpd(server);
+
+        const int socket = httpd.open();
+        PsychicWebSocketProxy::Client client = server.accept();
+        uint8_t buffer[16];
+        CHECK(client.read(buffer, sizeof(buffer)) == 0);
+        CHECK(client.peek() == -1);
+
+        // and again after the buffered data is consumed
+        CHECK(httpd.send(socket, "abc") == ESP_OK);
+        CHECK(client.read(buffer, sizeof(buffer)) == 3);
+        CHECK(client.read(buffer, sizeof(buffer)) == 0);
+    }
+}
+
+static void test_accept_order() {
+    Server server;
+    fake::Httpd httpd(server);
+
+    const int first = httpd.open();
+    const int second = httpd.open();
+    CHECK(httpd.send(first, "1") == ESP_OK);
+    CHECK(httpd.send(second, "2") == ESP_OK);
+
+    PsychicWebSocketProxy::Client a = server.accept();
+    PsychicWebSocketProxy::Client b = server.accept();
+    CHECK(read_all(a) == "1");
+    CHECK(read_all(b) == "2");
+}
+
+static void test_peer_close() {
+    Server server;
+    fake::Httpd httpd(server);
+
+    const int socket = httpd.open();
+    PsychicWebSocketProxy::Client client = server.accept();
+    CHECK(httpd.send(socket, "bye") == ESP_OK);
+    httpd.close(socket);
+
+    // unread data is still available after the peer disconnects
+    CHECK(!client.connected());
+    CHECK(client);
+    CHECK(read_all(client) == "bye");
+    CHECK(!client);
+    CHECK(client.write((const uint8_t *) "x", 1) == 0);
+}
+
+static void test_stop() {
+    Server server;
+    fake::Httpd httpd(server);
+
+    const int socket = httpd.open();
+    PsychicWebSocketProxy::Client client = server.accept();
+    CHECK(httpd.send(socket, "data") == ESP_OK);
+
+    client.stop(4000);
+    CHECK(!client.connected());
+    CHECK(!client);     // buffers are dropped right away
+
+    httpd.sync();
+    CHECK(!httpd.is_open(socket));
+    CHECK(httpd.session_count() == 0);
+}
+
+static void test_stop_sends_close_frame() {
+    Server server;
+    fake::Httpd httpd(server);
+
+    const int socket = httpd.open();
+    PsychicWebSocketProxy::Client client = server.accept();
+    client.stop(4000);
+    httpd.sync();
+
+    const auto sent = httpd.sent(socket);
+    CHECK(sent.size() == 1);
+    CHECK(sent[0].type == HTTPD_WS_TYPE_CLOSE);
+    CHECK(sent[0].payload == std::string("\x0f\xa0", 2));
+}
+
+static void test_scatter_gather_write() {
+    Server server;
+    fake::Httpd httpd(server);
+
+    const int socket = httpd.open();
+    PsychicWebSocketProxy::Client client = server.accept();
+    CHECK(client.write({{"head", 4}, {"", 0}, {"er", 2}}) == 6);
+
+    const auto sent = httpd.sent(socket);
+    CHECK(sent.size() == 1);
+    CHECK(sent[0].payload == "header");
+}
+
+static void test_scatter_gather_write_edge_cases() {
+    Server server;
+    fake::Httpd httpd(server);
+
+    const int socket = httpd.open();
+    PsychicWebSocketProxy::Client client = server.accept();
+
+    // no segments, no frame
+    CHECK(client.write((const Segment *) nullptr, 0) == 0);
+    CHECK(httpd.sent(socket).empty());
+
+    // the send buffer keeps the size of the largest message until it's released
+    const std::string large(64 * 1024, 'x');
+    CHECK(client.write({{large.data(), large.size()}, {"!", 1}}) == large.size() + 1);
+#if !defined(__SANITIZE_ADDRESS__) && !defined(__SANITIZE_THREAD__)
+    const size_t heap_before = fake::heap_in_use();
+    client.release_send_buffer();
+    CHECK(heap_before - fake::heap_in_use() > large.size());
+#else
+    // the sanitizers replace malloc, heap_in_use() doesn't work with them
+    client.release_send_buffer();
+#endif
+
+    // it's allocated again when needed
+    CHECK(client.write({{"a", 1}, {"b", 1}}) == 2);
+    const auto sent = httpd.sent(socket);
+    CHECK(sent.size() == 2);
+    CHECK(sent[1].payload == "ab");
+}
+
+static void test_drop_last_client_closes_session() {
+    Server server;
+    fake::Httpd httpd(server);
+
+    const int socket = httpd.open();
+    {
+        PsychicWebSocketProxy::Client client = server.accept();
+        PsychicWebSocketProxy::Client copy = client;
+        copy = PsychicWebSocketProxy::Client();
+        CHECK(client.connected());
+    }
+    httpd.sync();
+    CHECK(!httpd.is_open(socket));
+    CHECK(httpd.send(socket, "late") == ESP_FAIL);
+}
+
+static void test_concurrent_release_closes_session() {
+    // two copies of the last Client dropped at the same time, exactly one of them must close the session (this only
+    // has a chance to catch a race on a multi-core machine)
+    Server server;
+    fake::Httpd httpd(server);
+
+    for (int i = 0; i < 1000; ++i) {
+        const int socket = httpd.open();
+        PsychicWebSocketProxy::Client first = server.accept();
+        PsychicWebSocketProxy::Client second = first;
+
+        std::atomic<int> ready(0);
+        auto drop = [&ready](PsychicWebSocketProxy::Client & client) {
+            ++ready;
+            while (ready < 2) {
+                std::this_thread::yield();
+            }
+            client = PsychicWebSocketProxy::Client();
+        };
+        std::thread thread(drop, std::ref(first));
+        drop(second);
+        thread.join();
+
+        httpd.sync();
+        CHECK(!httpd.is_open(socket));
+    }
+}
+
+static void test_client_size() {
+    // a Client is just a reference counted pointer to the proxy
+    CHECK(sizeof(PsychicWebSocketProxy::Client) == sizeof(::Client) + sizeof(Proxy *));
+}
+
+static void test_handler_failure_closes_session() {
+    Server server([] { return new SingleFrameProxy(50); });
+    fake::Httpd httpd(server);
+
+    const int socket = httpd.open();
+    PsychicWebSocketProxy::Client client = server.accept();
+
+    CHECK(httpd.send(socket, "first") == ESP_OK);
+    // the previous frame isn't consumed, so this one times out
+    CHECK(httpd.send(socket, "second") == ESP_ERR_NO_MEM);
+    CHECK(!httpd.is_open(socket));
+    CHECK(!client.connected());
+    CHECK(httpd.frames_failed() == 1);
+}
+
+static void test_server_destroyed_with_pending_clients() {
+    Server * server = new Server();
+    {
+        fake::Httpd httpd(*server);
+        httpd.open();
+        httpd.open();
+    }
+    // both sessions were closed, but never accepted
+    delete server;
+}
+
+static void test_keepalive_ping_doesnt_overlap_writes() {
+    Server server;
+    fake::Httpd httpd(server);
+
+    const int socket = httpd.open();
+    PsychicWebSocketProxy::Client client = server.accept();
+    httpd.set_send_delay_us(500);
+    // the test doesn't respond to pings, so don't close the connection
+    server.set_keepalive(1, 0);
+
+    for (int i = 0; i < 100; ++i) {
+        CHECK(client.write((const uint8_t *) "x", 1) == 1);
+    }
+    server.set_keepalive(0);
+    httpd.sync();
+
+    unsigned int pings = 0;
+    for (const auto & frame : httpd.sent(socket)) {
+        pings += (frame.type == HTTPD_WS_TYPE_PING) ? 1 : 0;
+    }
+    CHECK(pings > 0);
+    CHECK(httpd.concurrent_sends() == 0);
+}
+
+static void test_keepalive_closes_unresponsive() {
+    Server server;
+    fake::Httpd httpd(server);
+
+    const int silent = httpd.open();
+    PsychicWebSocketProxy::Client silent_client = server.accept();
+    const int alive = httpd.open();
+    PsychicWebSocketProxy::Client alive_client = server.accept();
+    CHECK(httpd.send(silent, "unread") == ESP_OK);
+
+    server.set_keepalive(50, 2);
+    const unsigned long start = millis();
+    while (httpd.is_open(silent) && (millis() - start < 2000)) {
+        // PONGs and data frames both count as responses
+        CHECK(httpd.send(alive, "", HTTPD_WS_TYPE_PONG) == ESP_OK);
+        CHECK(httpd.send(alive, "x") == ESP_OK);
+        CHECK(alive_client.read() == 'x');
+        delay(5);
+    }
+    server.set_keepalive(0);
+    httpd.sync();
+
+    CHECK(!httpd.is_open(silent));
+    CHECK(!silent_client.connected());
+    // the buffers are released right away
+    CHECK(!silent_client);
+    CHECK(httpd.is_open(alive));
+    CHECK(alive_client.connected());
+    CHECK(server.get_keepalive_closes() == 1);
+
+    unsigned int pings = 0;
+    for (const auto & frame : httpd.sent(silent)) {
+        pings += (frame.type == HTTPD_WS_TYPE_PING) ? 1 : 0;
+    }
+    CHECK(pings == 2);
+}
+
+static void test_control_frames() {
+    Server server;
+    fake::Httpd httpd(server);
+
+    const int socket = httpd.open();
+    PsychicWebSocketProxy::Client client = server.accept();
+
+    // PINGs are answered with a PONG carrying the same payload, PONGs are consumed, neither reaches the proxy
+    CHECK(httpd.send(socket, "PI", HTTPD_WS_TYPE_PING) == ESP_OK);
+    CHECK(httpd.send(socket, "PO", HTTPD_WS_TYPE_PONG) == ESP_OK);
+    CHECK(client.available() == 0);
+    auto sent = httpd.sent(socket);
+    CHECK(sent.size() == 1);
+    CHECK(sent[0].type == HTTPD_WS_TYPE_PONG);
+    CHECK(sent[0].payload == "PI");
+
+    // control frames can't carry more than 125 bytes
+    CHECK(httpd.send(socket, std::string(126, 'x'), HTTPD_WS_TYPE_PING) == ESP_FAIL);
+    CHECK(!httpd.is_open(socket));
+
+    // CLOSE is answered with the same status code and closes the session, the data received before stays readable
+    const int second = httpd.open();
+    client = server.accept();
+    CHECK(httpd.send(second, "abc") == ESP_OK);
+    CHECK(httpd.send(second, std::string("\x03\xe8", 2), HTTPD_WS_TYPE_CLOSE) == ESP_OK);
+    httpd.sync();
+    CHECK(!httpd.is_open(second));
+    CHECK(!client.connected());
+    CHECK(read_all(client) == "abc");
+    sent = httpd.sent(second);
+    CHECK(sent.size() == 1);
+    CHECK(sent[0].type == HTTPD_WS_TYPE_CLOSE);
+    CHECK(sent[0].payload == std::string("\x03\xe8", 2));
+
+    // without a status code, the reply is a normal closure
+    const int third = httpd.open();
+    client = server.accept();
+    CHECK(httpd.send(third, "", HTTPD_WS_TYPE_CLOSE) == ESP_OK);
+    httpd.sync();
+    CHECK(!httpd.is_open(third));
+    sent = httpd.sent(third);
+    CHECK(sent.size() == 1);
+    CHECK(sent[0].payload == std::string("\x03\xe8", 2));
+}
+
+static void test_control_frames_not_rate_limited() {
+    Server server;
+    server.set_rate_limit(0, 1, Server::RATE_LIMIT_CLOSE);
+    fake::Httpd httpd(server);
+
+    const int socket = httpd.open();
+    PsychicWebSocketProxy::Client client = server.accept();
+    CHECK(httpd.send(socket, "a") == ESP_OK);
+    for (int i = 0; i < 5; ++i) {
+        CHECK(httpd.send(socket, "", HTTPD_WS_TYPE_PING) == ESP_OK);
+    }
+    CHECK(httpd.is_open(socket));
+    CHECK(server.get_throttled_frames() == 0);
+}
+
+static void test_server_destroyed_with_keepalive_queued() {
+    Server * server = new Server();
+    fake::Httpd httpd(*server);
+
+    // the keepalive timer only starts queueing work once a client connected
+    httpd.close(httpd.open());
+
+    // keep the httpd task busy, so that the keepalive check is queued, but not run when the server is destroyed
+    httpd.queue_work([] { delay(50); });
+    server->set_keepalive(1);
+    delay(10);
+    delete server;
+    httpd.sync();
+}
+
+static void test_direct_dispatch() {
+    std::string received;
+    Server server([&received] {
+        return new DirectDispatchProxy([&received](Proxy & proxy, const uint8_t * data, size_t size,
+        httpd_ws_type_t type) {
+            received.append((const char *) data, size);
+            proxy.send("ack", 3);
+        });
+    });
+    fake::Httpd httpd(server);
+
+    const int socket = httpd.open();
+    CHECK(httpd.send(socket, "ping") == ESP_OK);
+    CHECK(received == "ping");
+    const auto sent = httpd.sent(socket);
+    CHECK(sent.size() == 1);
+    CHECK(sent[0].payload == "ack");
+
+    // the connection isn't queued for accept(), it's kept open by the session
+    CHECK(!server.accept());
+    httpd.sync();
+    CHECK(httpd.is_open(socket));
+    CHECK(server.get_stats().connections_opened == 1);
+    CHECK(server.get_stats().connections_accepted == 0);
+
+    httpd.close(socket);
+    CHECK(server.get_stats().connections_closed == 1);
+}
+
+static void test_direct_dispatch_client() {
+    std::vector<PsychicWebSocketProxy::Client> clients;
+    std::string received;
+    Server server([&clients, &received] {
+        return new DirectDispatchProxy([&clients](PsychicWebSocketProxy::Client client) {
+            CHECK(client.connected());
+            clients.push_back(client);
+        }, [&received](Proxy & proxy, const uint8_t * data, size_t size, httpd_ws_type_t type) {
+            received.append((const char *) data, size);
+        });
+    });
+    fake::Httpd httpd(server);
+
+    const int first = httpd.open();
+    const int second = httpd.open();
+    CHECK(clients.size() == 2);
+    CHECK(!server.accept());
+
+    // the Clients can be used for writing from anywhere
+    CHECK(clients[0].write((const uint8_t *) "one", 3) == 3);
+    CHECK(clients[1].write({{"tw", 2}, {"o", 1}}) == 3);
+    CHECK(httpd.sent(first).size() == 1);
+    CHECK(httpd.sent(first)[0].payload == "one");
+    CHECK(httpd.sent(second)[0].payload == "two");
+
+    // dropping them doesn't close the connection
+    clients.pop_back();
+    httpd.sync();
+    CHECK(httpd.is_open(second));
+    CHECK(httpd.send(second, "still here") == ESP_OK);
+    CHECK(received == "still here");
+
+    // they stay safe to use after the connection closes
+    httpd.close(first);
+    CHECK(!clients[0].connected());
+    CHECK(!clients[0]);
+    CHECK(clients[0].write((const uint8_t *) "late", 4) == 0);
+    CHECK(httpd.sent(first).size() == 1);
+}
+
+static void test_direct_dispatch_overrun() {
+    DirectDispatchProxy::Handler slow = [](Proxy & proxy, const uint8_t * data, size_t size, httpd_ws_type_t type) {
+        delay(5);
+    };
+
+    {
+        // overruns close the connection by default
+        Server server([slow] { return new DirectDispatchProxy(slow, 1000); });
+        fake::Httpd httpd(server);
+        const int socket = httpd.open();
+        CHECK(httpd.send(socket, "x") == ESP_FAIL);
+        CHECK(!httpd.is_open(socket));
+    }
+
+    {
+        Server server([slow] { return new DirectDispatchProxy(slow, 1000, ESP_OK); });
+        fake::Httpd httpd(server);
+        const int socket = httpd.open();
+        CHECK(httpd.send(socket, "x") == ESP_OK);
+        CHECK(httpd.is_open(socket));
+    }
+}
+
+static void test_rate_limit_delay() {
+    Server server;
+    server.set_rate_limit(1000, 0);
+    fake::Httpd httpd(server);
+
+    const int socket = httpd.open();
+    PsychicWebSocketProxy::Client client = server.accept();
+
+    // the first frames empty the bucket and leave it in debt, the next one has to wait until it's paid off
+    CHECK(httpd.send(socket, std::string(1000, 'a')) == ESP_OK);
+    CHECK(read_all(client).size() == 1000);
+    CHECK(httpd.send(socket, std::string(10, 'b')) == ESP_OK);
+    CHECK(read_all(client).size() == 10);
+    const unsigned long start = millis();
+    CHECK(httpd.send(socket, "c") == ESP_OK);
+    CHECK(millis() - start >= 5);
+    CHECK(read_all(client) == "c");
+    CHECK(server.get_throttled_frames() >= 1);
+}
+
+static void test_rate_limit_oversized_frame_not_delayed() {
+    Server server;
+    server.set_rate_limit(100, 0);
+    fake::Httpd httpd(server);
+
+    const int socket = httpd.open();
+    PsychicWebSocketProxy::Client client = server.accept();
+
+    // waiting for a frame larger than the bucket used to stall the server for seconds, it's dropped instead
+    const unsigned long start = millis();
+    CHECK(httpd.send(socket, std::string(1000, 'x')) == ESP_OK);
+    CHECK(millis() - start < 100);
+    CHECK(client.available() == 0);
+    CHECK(server.get_throttled_frames() == 1);
+
+    // the dropped frame didn't use up the bucket
+    CHECK(httpd.send(socket, "ok") == ESP_OK);
+    CHECK(read_all(client) == "ok");
+    CHECK(httpd.is_open(socket));
+}
+
+static void test_rate_limit_drop() {
+    Server server;
+    server.set_rate_limit(4096, 0, Server::RATE_LIMIT_DROP);
+    fake::Httpd httpd(server);
+
+    const int socket = httpd.open();
+    PsychicWebSocketProxy::Client client = server.accept();
+
+    CHECK(httpd.send(socket, std::string(4000, 'a')) == ESP_OK);
+    CHECK(read_all(client).size() == 4000);
+    CHECK(httpd.send(socket, std::string(1000, 'b')) == ESP_OK);
+    CHECK(read_all(client).size() == 1000);
+
+    // the bucket is empty, small frames are dropped
+    CHECK(httpd.send(socket, std::string(1024, 'c')) == ESP_OK);
+    CHECK(client.available() == 0);
+    CHECK(httpd.is_open(socket));
+
+    // larger frames can't be read into the drop buffer, the connection gets closed
+    CHECK(httpd.send(socket, std::string(1025, 'd')) == ESP_ERR_INVALID_SIZE);
+    CHECK(!httpd.is_open(socket));
+    const auto sent = httpd.sent(socket);
+    CHECK(sent.size() == 1);
+    CHECK(sent[0].type == HTTPD_WS_TYPE_CLOSE);
+    CHECK(sent[0].payload == std::string("\x03\xf1", 2));
+    CHECK(server.get_throttled_frames() == 2);
+}
+
+static void test_rate_limit_action_changed_while_running() {
+    Server server;
+    server.set_rate_limit(10, 0, Server::RATE_LIMIT_DROP);
+    fake::Httpd httpd(server);
+
+    const int socket = httpd.open();
+    PsychicWebSocketProxy::Client client = server.accept();
+
+    // the second frame leaves the bucket in debt for about a second
+    CHECK(httpd.send(socket, "0123456789") == ESP_OK);
+    CHECK(read_all(client).size() == 10);
+    CHECK(httpd.send(socket, "0123456789") == ESP_OK);
+    CHECK(read_all(client).size() == 10);
+    CHECK(httpd.send(socket, "x") == ESP_OK);
+    CHECK(client.available() == 0);
+    CHECK(httpd.is_open(socket));
+
+    // the new action applies to the open connection right away
+    std::thread([&server] { server.set_rate_limit(10, 0, Server::RATE_LIMIT_CLOSE); }).join();
+    CHECK(httpd.send(socket, "y") == ESP_FAIL);
+    CHECK(!httpd.is_open(socket));
+}
+
+static void test_stats() {
+    Server server;
+    fake::Httpd httpd(server);
+
+    const int first = httpd.open();
+    const int second = httpd.open();
+    PsychicWebSocketProxy::Client client = server.accept();
+    CHECK(httpd.send(first, "abc") == ESP_OK);
+    CHECK(read_all(client) == "abc");
+    CHECK(httpd.send(first, "de") == ESP_OK);
+    httpd.close(second);
+
+    const Server::Stats stats = server.get_stats();
+    CHECK(stats.connections_opened == 2);
+    CHECK(stats.connections_accepted == 1);
+    CHECK(stats.connections_closed == 1);
+    CHECK(stats.frames_received == 2);
+    CHECK(stats.bytes_received == 5);
+    CHECK(stats.recv_errors == 0);
+}
+
+int main() {
+    test_accept_and_exchange();
+    test_read_empty();
+    test_accept_order();
+    test_peer_close();
+    test_stop();
+    test_stop_sends_close_frame();
+    test_scatter_gather_write();
+    test_scatter_gather_write_edge_cases();
+    test_drop_last_client_closes_session();
+    test_concurrent_release_closes_session();
+    test_client_size();
+    test_handler_failure_closes_session();
+    test_server_destroyed_with_pending_clients();
+    test_keepalive_ping_doesnt_overlap_writes();
+    test_keepalive_closes_unresponsive();
+    test_control_frames();
+    test_control_frames_not_rate_limited();
+    test_server_destroyed_with_keepalive_queued();
+    test_direct_dispatch();
+    test_direct_dispatch_client();
+    test_direct_dispatch_overrun();
+    test_rate_limit_delay();
+    test_rate_limit_oversized_frame_not_delayed();
+    test_rate_limit_drop();
+    test_rate_limit_action_changed_while_running();
+    test_stats();
+    puts("ok");
+    return 0;
+}
@@ -0,0 +1,223 @@
+/* Tests of FrameTracer.
+ *
+ * Usage: test_tracer [TRACE_FILE]
+ *
+ * If TRACE_FILE is given, a trace of a few connections is recorded into it.  It's replayed by the replay tests.
+ */
+
+#include <condition_variable>
+#include <thread>
+
+#include <PsychicWebSocketProxy.h>
+
+#include "check.h"
+#include "fake_httpd.h"
+
+using namespace PsychicWebSocketProxy;
+
+// Sink collecting everything written to it, writes block while the sink is paused
+class MemorySink: public Print {
+    public:
+        MemorySink(): paused(false), writing(false) {}
+
+        virtual size_t write(uint8_t c) override { return write(&c, 1); }
+
+        virtual size_t write(const uint8_t * buffer, size_t size) override {
+            std::unique_lock<std::mutex> lock(mutex);
+            writing = true;
+            cond.notify_all();
+            cond.wait(lock, [this] { return !paused; });
+            data.append((const char *) buffer, size);
+            writing = false;
+            return size;
+        }
+
+        void pause() {
+            const std::lock_guard<std::mutex> lock(mutex);
+            paused = true;
+        }
+
+        void resume() {
+            const std::lock_guard<std::mutex> lock(mutex);
+            paused = false;
+            cond.notify_all();
+        }
+
+        void wait_for_write() {
+            std::unique_lock<std::mutex> lock(mutex);
+            cond.wait(lock, [this] { return writing; });
+        }
+
+        std::vector<FrameTracer::Record> records() {
+            const std::lock_guard<std::mutex> lock(mutex);
+            CHECK(data.size() % sizeof(FrameTracer::Record) == 0);
+            const FrameTracer::Record * begin = (const FrameTracer::Record *) data.data();
+            return std::vector<FrameTracer::Record>(begin, begin + data.size() / sizeof(FrameTracer::Record));
+        }
+
+    protected:
+        std::mutex mutex;
+        std::condition_variable cond;
+        std::string data;
+        bool paused;
+        bool writing;
+};
+
+static void test_record_format() {
+    CHECK(sizeof(FrameTracer::Record) == 16);
+}
+
+static void test_records_written_by_flush_only() {
+    MemorySink sink;
+    FrameTracer tracer(sink, 4);
+
+    for (uint32_t i = 0; i < 6; ++i) {
+        tracer.record(FrameTracer::FRAME, 1, HTTPD_WS_TYPE_BINARY, i, 0);
+    }
+    // the first buffer filled up, but record() doesn't write
+    CHECK(sink.records().empty());
+
+    tracer.flush();
+    const auto records = sink.records();
+    CHECK(records.size() == 6);
+    for (uint32_t i = 0; i < 6; ++i) {
+        CHECK(records[i].event == FrameTracer::FRAME);
+        CHECK(records[i].a == i);
+    }
+    CHECK(tracer.get_dropped_records() == 0);
+}
+
+static void test_records_dropped_when_buffers_full() {
+    MemorySink sink;
+    FrameTracer tracer(sink, 2);
+
+    for (uint32_t i = 0; i < 7; ++i) {
+        tracer.record(FrameTracer::FRAME, 1, HTTPD_WS_TYPE_BINARY, i, 0);
+    }
+    CHECK(tracer.get_dropped_records() == 3);
+
+    tracer.flush();
+    auto records = sink.records();
+    CHECK(records.size() == 4);
+    CHECK(records.back().a == 3);
+
+    // there's space again after flushing
+    tracer.record(FrameTracer::CLOSE, 1);
+    tracer.flush();
+    records = sink.records();
+    CHECK(records.size() == 5);
+    CHECK(records.back().event == FrameTracer::CLOSE);
+    CHECK(tracer.get_dropped_records() == 3);
+}
+
+static void test_record_during_flush() {
+    MemorySink sink;
+    FrameTracer tracer(sink, 3);
+
+    tracer.record(FrameTracer::OPEN, 1);
+    for (int i = 0; i < 3; ++i) {
+        tracer.record(FrameTracer::FRAME, 1);
+    }
+
+    // a slow sink must not block recording into the other buffer
+    sink.pause();
+    std::thread flusher([&tracer] { tracer.flush(); });
+    sink.wait_for_write();
+    tracer.record(FrameTracer::READ, 1);
+    tracer.record(FrameTracer::READ, 1);
+    sink.resume();
+    flusher.join();
+
+    tracer.record(FrameTracer::CLOSE, 1);
+    tracer.flush();
+    const auto records = sink.records();
+    CHECK(records.size() == 7);
+    CHECK(records[0].event == FrameTracer::OPEN);
+    CHECK(records[4].event == FrameTracer::READ);
+    CHECK(records[6].event == FrameTracer::CLOSE);
+    CHECK(tracer.get_dropped_records() == 0);
+}
+
+static void test_server_trace() {
+    MemorySink sink;
+    FrameTracer tracer(sink);
+    Server server;
+    server.set_tracer(&tracer);
+    fake::Httpd httpd(server);
+
+    const int socket = httpd.open();
+    PsychicWebSocketProxy::Client client = server.accept();
+    CHECK(httpd.send(socket, "hello") == ESP_OK);
+    uint8_t buffer[8];
+    CHECK(client.read(buffer, sizeof(buffer)) == 5);
+    httpd.close(socket);
+    tracer.flush();
+
+    const auto records = sink.records();
+    CHECK(records.size() == 5);
+    CHECK(records[0].event == FrameTracer::OPEN);
+    CHECK(records[1].event == FrameTracer::FRAME);
+    CHECK(records[1].type == HTTPD_WS_TYPE_BINARY);
+    CHECK(records[1].a == 5);
+    CHECK(records[2].event == FrameTracer::RECV);
+    CHECK(records[2].b == ESP_OK);
+    CHECK(records[3].event == FrameTracer::READ);
+    CHECK(records[3].a == sizeof(buffer));
+    CHECK(records[3].b == 5);
+    CHECK(records[4].event == FrameTracer::CLOSE);
+    for (const auto & record : records) {
+        CHECK(record.connection == records[0].connection);
+    }
+}
+
+// Sink writing to a file
+class FileSink: public Print {
+    public:
+        FileSink(const char * path): file(fopen(path, "wb")) { CHECK(file); }
+        ~FileSink() { fclose(file); }
+
+        virtual size_t write(uint8_t c) override { return write(&c, 1); }
+        virtual size_t write(const uint8_t * buffer, size_t size) override { return fwrite(buffer, 1, size, file); }
+        virtual void flush() override { fflush(file); }
+
+    protected:
+        FILE * const file;
+};
+
+// Record a few connections with different frame sizes and a consumer, which reads in small chunks
+static void write_sample_trace(const char * path) {
+    FileSink sink(path);
+    FrameTracer tracer(sink);
+    Server server;
+    server.set_tracer(&tracer);
+    fake::Httpd httpd(server);
+
+    for (int connection = 0; connection < 3; ++connection) {
+        const int socket = httpd.open();
+        PsychicWebSocketProxy::Client client = server.accept();
+        for (size_t size = 1; size <= 4096; size *= 4) {
+            httpd.post(socket, std::string(size + connection, 'x'));
+            delay(1);
+            uint8_t buffer[256];
+            while (client.read(buffer, sizeof(buffer)) > 0) {}
+            tracer.flush();
+        }
+        httpd.close(socket);
+    }
+
+    tracer.flush();
+    CHECK(tracer.get_dropped_records() == 0);
+}
+
+int main(int argc, char ** argv) {
+    test_record_format();
+    test_records_written_by_flush_only();
+    test_records_dropped_when_buffers_full();
+    test_record_during_flush();
+    test_server_trace();
+    if (argc > 1) {
+        write_sample_trace(argv[1]);
+    }
+    puts("ok");
+    return 0;
+}